@@ -11,6 +11,9 @@
 #include "real_call.h"
 #include "stat_cache.h"
 #include "process.h"
+#include "replay.h"
+#include "content_store.h"
+#include "search_path.h"
 #include <stdlib.h>
 
 // Special case hack flags
@@ -36,7 +39,7 @@ static void new_node(struct process *process, enum action_type type, const struc
 
     char buffer[SHOW_HASH_SIZE*parents->n + 3 + SHOW_HASH_SIZE + 1 + SHOW_NODE_SIZE];
     char *p = buffer;
-    if (is_verbose()) {
+    if (waitless_env->verbose) {
         p += snprintf(p, sizeof(buffer), "%d: ", getpid());
         int i;
         for (i = 0; i < parents->n; i++) {
@@ -53,7 +56,7 @@ static void new_node(struct process *process, enum action_type type, const struc
     parents->n = 1;
     subgraph_new_node(parents->p, type, data);
 
-    if (is_verbose()) {
+    if (waitless_env->verbose) {
         p = show_hash(p, 8, parents->p+0);
         p = stpcpy(p, ": ");
         p = show_subgraph_node(p, type, data);
@@ -162,6 +165,7 @@ void action_close_read(int fd)
 void action_open_write(const char *path, const struct hash *path_hash)
 {
     wlog("action_open_write(%s)", path);
+    stat_cache_forget_parents();
     snapshot_init();
     shared_map_lock(&snapshot);
     struct snapshot_entry *entry;
@@ -196,6 +200,9 @@ void action_close_write(int fd)
     struct hash contents_hash;
     stat_cache_update_fd(&contents_hash, fd, &info->path_hash);
 
+    // Keep a copy of the contents so that replay can restore them later
+    content_store_fd(&contents_hash, fd);
+
     // Update snapshot
     shared_map_lock(&snapshot);
     struct snapshot_entry *entry;
@@ -227,17 +234,18 @@ pid_t action_fork(void)
 {
     // Lock both parent (self) and master
     struct process *process = lock_process();
-    struct process *master = process->master ? find_process_info(process->master) : process;
+    struct process *master = master_process_info(process);
     if (process != master)
         spin_lock(&master->lock);
 
     // Save mutable information about process
-    struct fd_map fds = process->fds;
+    struct fd_map fds;
+    fd_map_copy(&fds, &process->fds);
     int flags = process->flags;
 
     // Analyze open file descriptors
     int linked = 0, fd;
-    for (fd = 0; fd < MAX_FDS; fd++) {
+    for (fd = 0; fd < fds.fds; fd++) {
         int slot = fds.map[fd];
         if (slot) {
             struct fd_info *info = fds.info + slot;
@@ -261,9 +269,10 @@ pid_t action_fork(void)
     memset(&one_hash, -1, sizeof(struct hash));
 
     // Add a fork node to the subgraph
-    new_node(master, SG_FORK, linked ? &zero_hash : &zero_hash);
+    new_node(master, SG_FORK, linked ? &zero_hash : &one_hash);
     struct hash fork_node = master->parents.p[0];
     wlog("fork: linked %d", linked);
+    uint32_t master_entry = linked ? link_process_info(master) : 0;
 
     // Actually fork
     pid_t pid = real_fork();
@@ -271,11 +280,12 @@ pid_t action_fork(void)
         die("action_fork: fork failed: %s", strerror(errno));
 
     if (!pid) {
+        inverse_map_forked();
         struct process *child = new_process_info();
         child->flags = flags;
         if (linked) {
             wlog("linking to %d", master->pid);
-            child->master = master->pid;
+            child->master = master_entry;
         }
         else {
             wlog("child of %d (master %d)", process->pid, master->pid);
@@ -285,10 +295,10 @@ pid_t action_fork(void)
             wlog("fresh process: master 0x%x", child->master);
         }
         // Copy fd_map information to child
-        memcpy(&child->fds, &fds, sizeof(struct fd_map));
+        fd_map_copy(&child->fds, &fds);
         // Drop fds with close-on-exec set
         int fd;
-        for (fd = 0; fd < MAX_FDS; fd++)
+        for (fd = 0; fd < fds.fds; fd++)
             if (child->fds.cloexec[fd])
                 child->fds.map[fd] = 0;
         unlock_process();
@@ -309,6 +319,65 @@ pid_t action_fork(void)
     return pid;
 }
 
+// Mark a candidate of a PATH search as statted in the snapshot, so that
+// creating it later in the build dies as it would after a real stat.  The
+// search already knows whether it exists, so the stat cache isn't needed.
+static void search_probed(const char *path, int exists)
+{
+    struct hash path_hash, exists_hash;
+    remember_hash_path(&path_hash, path);
+    memset(&exists_hash, exists ? -1 : 0, sizeof(exists_hash));
+    struct snapshot_entry *entry = snapshot_record(&exists_hash, path, &path_hash);
+    entry->stat = 1;
+    shared_map_unlock(&snapshot);
+}
+
+/*
+ * A PATH search is recorded as a single search node whose data is the search
+ * record, followed by a file-like parent naming the result: the hash of the
+ * path found, or zero if there was none.  Each candidate probed is still
+ * marked in the snapshot as if it had been statted.
+ */
+const char *action_search_path(char buffer[PATH_MAX], const char *file, const char *PATH)
+{
+    if (strchr(file, '/'))
+        return file;
+
+    struct hash record_hash, found_hash;
+    const char *path = search_path(buffer, file, PATH, &record_hash, search_probed);
+    if (path)
+        hash_string(&found_hash, path);
+    else
+        memset(&found_hash, 0, sizeof(found_hash));
+
+    struct process *process = lock_master_process();
+    new_node(process, SG_SEARCH, &record_hash);
+    add_parent(process, &found_hash);
+    unlock_master_process();
+
+    if (!path)
+        errno = ENOENT;
+    return path;
+}
+
+/*
+ * Replay skips the new process entirely, so anything it would have written
+ * through inherited file descriptors would be lost.
+ */
+static int can_replay()
+{
+    if (waitless_env->force)
+        return 0;
+    struct process *process = process_info();
+    int fd;
+    for (fd = 0; fd < process->fds.fds; fd++) {
+        int slot = process->fds.map[fd];
+        if (slot && !process->fds.cloexec[fd] && (process->fds.info[slot].flags & O_WRONLY))
+            return 0;
+    }
+    return 1;
+}
+
 /*
  * action_execve adds an exec node to the subgraph and sets WAITLESS_PARENT
  * to the hash of the arguments.  The first node in the child process will
@@ -323,54 +392,22 @@ pid_t action_fork(void)
  * subgraph nodes from child and parent to be interleaved.  Since in the shared
  * case the child _does_ descend directly from the exec node, an explicit
  * record of argv and envp would be redundant.
+ *
+ * If the subgraph already contains the whole recorded run of an unlinked
+ * child and its inputs are unchanged, the exec is short-circuited by replay
+ * (see replay.h).
  */
 int action_execve(const char *path, const char *const argv[], const char *const envp[])
 {
     fd_map_dump();
     struct process *process = lock_master_process();
     int linked = process != process_info();
+    int root = !process->parents.n;
     wlog("exec: linked %d", linked);
 
-    // Pack all the arguments into a single buffer.  The format is
-    //     char path[];
-    //     uint32_t argc;
-    //     char argv[argc][];
-    //     char is_pipe;
-    //     uint32_t envc;
-    //     char envp[envc][];
-    //     char cwd[];
-    // with all strings packed together with terminating nulls.
-    char data[4096];
-    char *p = data;
-#define ADD_STR(s) p += strlcpy(p, (s), data+sizeof(data)-p) + 1
-    ADD_STR(path);
-    // encode argv
-    char *cp = p;
-    p += sizeof(uint32_t); // skip 4 bytes for len(argv)
-    uint32_t i;
-    for (i = 0; argv[i]; i++)
-        ADD_STR(argv[i]);
-    memcpy(cp, &i, sizeof(uint32_t));
-    *p++ = linked;
-    // encode envp
-    cp = p;
-    p += sizeof(uint32_t); // skip 4 bytes for len(envp)
-    uint32_t count;
-    for (i = 0; envp[i]; i++)
-        if (!startswith(envp[i], "WAITLESS")) {
-            ADD_STR(envp[i]);
-            count++;
-        }
-    memcpy(cp, &count, sizeof(uint32_t));
-    // encode pwd
-    if (!real_getcwd(p, data+sizeof(data)-p))
-        die("action_execve: getcwd failed: %s", strerror(errno));
-    int n = p - data + strlen(p) + 1;
-#undef ADD_STR
-
     // Store exec data and create a corresponding exec node
     struct hash data_hash;
-    remember_hash_memory(&data_hash, data, n);
+    subgraph_exec_data(&data_hash, path, argv, envp, linked);
     new_node(process, SG_EXEC, &data_hash);
 
     // Add the program to the snapshot
@@ -396,15 +433,26 @@ int action_execve(const char *path, const char *const argv[], const char *const
 
     unlock_master_process();
 
+    // If the new process would repeat a recorded run exactly, replay its writes
+    // and exit with the recorded status instead of running it.  Linked
+    // processes share their chain with the master, so they always run, and
+    // the root process has already been tried by waitless itself.
+    int status;
+    if (!linked && !root && can_replay() && replay_process(&data_hash, &program_hash, &status)) {
+        wlog("exec: replayed %s, exit %d", path, status);
+        real__exit(status);
+    }
+
     // Update process flags
     process = lock_process();
     int old_flags = process->flags;
     process->flags = 0;
-    p = rindex(path, '/');
+    const char *p = rindex(path, '/');
     const char *name = p ? p+1 : path;
     if (!strcmp(name, "as"))
         process->flags |= HACK_SKIP_O_STAT;
     else if (strstr(name, "-gcc-")) {
+        int i;
         for (i = 1; argv[i]; i++)
             if (!strcmp(argv[i], "-c")) {
                 process->flags |= HACK_SKIP_O_STAT;
@@ -431,7 +479,7 @@ void action_exit(int status)
     // Close all open file descriptors
     struct process *process = lock_process();
     int fd;
-    for (fd = 1; fd < MAX_FDS; fd++)
+    for (fd = 1; fd < process->fds.fds; fd++)
         if (process->fds.map[fd]) {
             // Call raw close to trigger action logic
             extern int close(int fd);
@@ -4,6 +4,7 @@
 #define __action_h__
 
 #include "fd_map.h"
+#include "arch.h"
 #include <sys/types.h>
 
 /*
@@ -43,6 +44,9 @@ void action_close_write(int fd);
 // Fork.  action_fork calls real_fork internally.
 pid_t action_fork(void);
 
+// Search PATH for an executable (see search_path.h).
+const char *action_search_path(char buffer[PATH_MAX], const char *file, const char *PATH);
+
 // Exec.  action_execve calls real_execve internally.
 int action_execve(const char *path, const char *const argv[], const char *const envp[]);
 
@@ -0,0 +1,306 @@
+// A compact portable implementation of the BLAKE3 hash function
+//
+// BLAKE3 splits its input into 1024 byte chunks, hashes each chunk with a
+// chain of 64 byte block compressions, and combines the chunk chaining values
+// in a binary tree whose left subtrees are always complete powers of two.  The
+// root compression is flagged as such and produces the output.  Here the tree
+// is walked recursively rather than with the incremental stack of the
+// reference implementation, since we always have the whole input in hand.
+
+#include <string.h>
+#include "blake3.h"
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+enum {
+    CHUNK_START = 1,
+    CHUNK_END = 2,
+    PARENT = 4,
+    ROOT = 8,
+};
+
+// Message word order for each round: the permutation applied repeatedly.
+// With the rounds unrolled, the compiler resolves these at compile time.
+static const uint8_t SCHEDULE[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store32(uint8_t *p, uint32_t w)
+{
+    p[0] = w;
+    p[1] = w >> 8;
+    p[2] = w >> 16;
+    p[3] = w >> 24;
+}
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(a, b, c, d, x, y) do { \
+    s[a] += s[b] + (x); s[d] = ROTR32(s[d] ^ s[a], 16); \
+    s[c] += s[d];       s[b] = ROTR32(s[b] ^ s[c], 12); \
+    s[a] += s[b] + (y); s[d] = ROTR32(s[d] ^ s[a], 8); \
+    s[c] += s[d];       s[b] = ROTR32(s[b] ^ s[c], 7); \
+    } while (0)
+
+#define ROUND(r) do { \
+    const uint8_t *o = SCHEDULE[r]; \
+    G(0, 4,  8, 12, m[o[0]],  m[o[1]]); \
+    G(1, 5,  9, 13, m[o[2]],  m[o[3]]); \
+    G(2, 6, 10, 14, m[o[4]],  m[o[5]]); \
+    G(3, 7, 11, 15, m[o[6]],  m[o[7]]); \
+    G(0, 5, 10, 15, m[o[8]],  m[o[9]]); \
+    G(1, 6, 11, 12, m[o[10]], m[o[11]]); \
+    G(2, 7,  8, 13, m[o[12]], m[o[13]]); \
+    G(3, 4,  9, 14, m[o[14]], m[o[15]]); \
+    } while (0)
+
+static void compress(uint32_t out[16], const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+    uint32_t block_len, uint64_t counter, uint32_t flags)
+{
+    uint32_t m[16], s[16];
+    int i;
+    for (i = 0; i < 16; i++)
+        m[i] = load32(block + 4*i);
+    memcpy(s, cv, 8*sizeof(uint32_t));
+    memcpy(s + 8, IV, 4*sizeof(uint32_t));
+    s[12] = counter;
+    s[13] = counter >> 32;
+    s[14] = block_len;
+    s[15] = flags;
+
+    ROUND(0);
+    ROUND(1);
+    ROUND(2);
+    ROUND(3);
+    ROUND(4);
+    ROUND(5);
+    ROUND(6);
+
+    for (i = 0; i < 8; i++) {
+        out[i] = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+// The last compression of a node, which becomes either a chaining value or,
+// with the ROOT flag, the output
+struct output
+{
+    uint32_t cv[8];
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint32_t block_len;
+    uint64_t counter;
+    uint32_t flags;
+};
+
+static void chunk_output(struct output *o, const uint8_t *p, size_t n, uint64_t chunk)
+{
+    uint32_t out[16];
+    uint32_t flags = CHUNK_START;
+    memcpy(o->cv, IV, sizeof(IV));
+    for (; n > BLAKE3_BLOCK_LEN; p += BLAKE3_BLOCK_LEN, n -= BLAKE3_BLOCK_LEN) {
+        compress(out, o->cv, p, BLAKE3_BLOCK_LEN, chunk, flags);
+        memcpy(o->cv, out, sizeof(o->cv));
+        flags = 0;
+    }
+    memset(o->block, 0, sizeof(o->block));
+    memcpy(o->block, p, n);
+    o->block_len = n;
+    o->counter = chunk;
+    o->flags = flags | CHUNK_END;
+}
+
+static void parent_output(struct output *o, const uint8_t children[2*BLAKE3_CV_LEN])
+{
+    memcpy(o->cv, IV, sizeof(IV));
+    memcpy(o->block, children, BLAKE3_BLOCK_LEN);
+    o->block_len = BLAKE3_BLOCK_LEN;
+    o->counter = 0;
+    o->flags = PARENT;
+}
+
+static void output_cv(const struct output *o, uint8_t cv[BLAKE3_CV_LEN])
+{
+    uint32_t out[16];
+    int i;
+    compress(out, o->cv, o->block, o->block_len, o->counter, o->flags);
+    for (i = 0; i < 8; i++)
+        store32(cv + 4*i, out[i]);
+}
+
+static void output_root(const struct output *o, uint8_t *out, size_t out_len)
+{
+    uint32_t words[16];
+    uint8_t bytes[BLAKE3_BLOCK_LEN];
+    int i;
+    compress(words, o->cv, o->block, o->block_len, 0, o->flags | ROOT);
+    for (i = 0; i < 16; i++)
+        store32(bytes + 4*i, words[i]);
+    memcpy(out, bytes, out_len);
+}
+
+// The largest power of two <= n, for n > 0
+static inline size_t largest_power_of_two(size_t n)
+{
+    return (size_t)1 << (63 - __builtin_clzll(n));
+}
+
+static void subtree_output(struct output *o, const uint8_t *p, size_t n, uint64_t chunk)
+{
+    if (n <= BLAKE3_CHUNK_LEN) {
+        chunk_output(o, p, n, chunk);
+        return;
+    }
+    // The left subtree gets the most whole chunks it can as a power of two,
+    // leaving at least one byte on the right
+    size_t left = BLAKE3_CHUNK_LEN * largest_power_of_two((n - 1) / BLAKE3_CHUNK_LEN);
+    uint8_t children[2*BLAKE3_CV_LEN];
+    blake3_subtree(children, p, left, chunk);
+    blake3_subtree(children + BLAKE3_CV_LEN, p + left, n - left, chunk + left / BLAKE3_CHUNK_LEN);
+    parent_output(o, children);
+}
+
+void blake3_subtree(uint8_t cv[BLAKE3_CV_LEN], const void *p, size_t n, uint64_t chunk)
+{
+    struct output o;
+    subtree_output(&o, p, n, chunk);
+    output_cv(&o, cv);
+}
+
+void blake3(uint8_t *out, size_t out_len, const void *p, size_t n)
+{
+    struct output o;
+    subtree_output(&o, p, n, 0);
+    output_root(&o, out, out_len);
+}
+
+// Same shape as subtree_output, one level up: since every subtree but the
+// last is the same power of two size, splitting by count matches splitting by
+// bytes.
+static void merge_cv(uint8_t cv[BLAKE3_CV_LEN], const uint8_t *cvs, size_t stride, size_t count);
+
+static void merge_output(struct output *o, const uint8_t *cvs, size_t stride, size_t count)
+{
+    size_t left = largest_power_of_two(count - 1);
+    uint8_t children[2*BLAKE3_CV_LEN];
+    merge_cv(children, cvs, stride, left);
+    merge_cv(children + BLAKE3_CV_LEN, cvs + left * stride, stride, count - left);
+    parent_output(o, children);
+}
+
+static void merge_cv(uint8_t cv[BLAKE3_CV_LEN], const uint8_t *cvs, size_t stride, size_t count)
+{
+    if (count == 1)
+        memcpy(cv, cvs, BLAKE3_CV_LEN);
+    else {
+        struct output o;
+        merge_output(&o, cvs, stride, count);
+        output_cv(&o, cv);
+    }
+}
+
+void blake3_root(uint8_t *out, size_t out_len, const uint8_t *cvs, size_t stride, size_t count)
+{
+    struct output o;
+    merge_output(&o, cvs, stride, count);
+    output_root(&o, out, out_len);
+}
+
+void blake3_init(struct blake3_hasher *h)
+{
+    memcpy(h->cv, IV, sizeof(IV));
+    h->block_len = h->blocks = h->stack_len = 0;
+    h->chunk = 0;
+}
+
+// Push the chaining value of a finished chunk, first merging it with every
+// completed subtree of the same size.  The number of merges is the number of
+// trailing zeros in the new chunk count.
+static void push_chunk(struct blake3_hasher *h, const uint8_t cv[BLAKE3_CV_LEN])
+{
+    uint8_t children[2*BLAKE3_CV_LEN];
+    uint64_t total = h->chunk + 1;
+    memcpy(children + BLAKE3_CV_LEN, cv, BLAKE3_CV_LEN);
+    for (; !(total & 1); total >>= 1) {
+        struct output o;
+        memcpy(children, h->stack[--h->stack_len], BLAKE3_CV_LEN);
+        parent_output(&o, children);
+        output_cv(&o, children + BLAKE3_CV_LEN);
+    }
+    memcpy(h->stack[h->stack_len++], children + BLAKE3_CV_LEN, BLAKE3_CV_LEN);
+}
+
+void blake3_update(struct blake3_hasher *h, const void *p, size_t n)
+{
+    const uint8_t *q = p;
+    uint32_t out[16];
+    while (n) {
+        // The last block of a chunk is held back until we know more input
+        // follows, since the final chunk's last block is compressed differently
+        if (h->block_len == BLAKE3_BLOCK_LEN) {
+            uint32_t flags = h->blocks ? 0 : CHUNK_START;
+            if (h->blocks == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1) {
+                struct output o;
+                uint8_t cv[BLAKE3_CV_LEN];
+                memcpy(o.cv, h->cv, sizeof(o.cv));
+                memcpy(o.block, h->block, BLAKE3_BLOCK_LEN);
+                o.block_len = BLAKE3_BLOCK_LEN;
+                o.counter = h->chunk;
+                o.flags = flags | CHUNK_END;
+                output_cv(&o, cv);
+                push_chunk(h, cv);
+                h->chunk++;
+                h->blocks = 0;
+                memcpy(h->cv, IV, sizeof(IV));
+            }
+            else {
+                compress(out, h->cv, h->block, BLAKE3_BLOCK_LEN, h->chunk, flags);
+                memcpy(h->cv, out, sizeof(h->cv));
+                h->blocks++;
+            }
+            h->block_len = 0;
+        }
+        size_t take = BLAKE3_BLOCK_LEN - h->block_len;
+        if (take > n)
+            take = n;
+        memcpy(h->block + h->block_len, q, take);
+        h->block_len += take;
+        q += take;
+        n -= take;
+    }
+}
+
+void blake3_final(const struct blake3_hasher *h, uint8_t *out, size_t out_len)
+{
+    struct output o;
+    memcpy(o.cv, h->cv, sizeof(o.cv));
+    memset(o.block, 0, sizeof(o.block));
+    memcpy(o.block, h->block, h->block_len);
+    o.block_len = h->block_len;
+    o.counter = h->chunk;
+    o.flags = (h->blocks ? 0 : CHUNK_START) | CHUNK_END;
+
+    // Fold in the subtrees to the left, from the smallest up
+    uint8_t children[2*BLAKE3_CV_LEN];
+    int i;
+    for (i = h->stack_len - 1; i >= 0; i--) {
+        memcpy(children, h->stack[i], BLAKE3_CV_LEN);
+        output_cv(&o, children + BLAKE3_CV_LEN);
+        parent_output(&o, children);
+    }
+    output_root(&o, out, out_len);
+}
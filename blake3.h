@@ -0,0 +1,50 @@
+// A compact portable implementation of the BLAKE3 hash function:
+// https://github.com/BLAKE3-team/BLAKE3-specs
+//
+// Only unkeyed hashing is supported, with outputs of up to BLAKE3_BLOCK_LEN
+// bytes.  blake3_subtree and blake3_root expose the tree structure so that
+// large inputs can be hashed in pieces (see hash_blake3.c).
+
+#ifndef __blake3_h__
+#define __blake3_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_CV_LEN 32
+#define BLAKE3_MAX_DEPTH 54 // enough for 2^64 bytes of input
+
+// State for incremental hashing: the current chunk, and the chaining values of
+// the completed subtrees to its left
+struct blake3_hasher
+{
+    uint32_t cv[8];
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint32_t block_len;
+    uint32_t blocks; // blocks compressed so far in this chunk
+    uint64_t chunk;
+    uint32_t stack_len;
+    uint8_t stack[BLAKE3_MAX_DEPTH][BLAKE3_CV_LEN];
+};
+
+// Hash n bytes of p into out_len <= BLAKE3_BLOCK_LEN bytes of out
+extern void blake3(uint8_t *out, size_t out_len, const void *p, size_t n);
+
+// Incremental hashing, equivalent to blake3 on the concatenated input
+extern void blake3_init(struct blake3_hasher *h);
+extern void blake3_update(struct blake3_hasher *h, const void *p, size_t n);
+extern void blake3_final(const struct blake3_hasher *h, uint8_t *out, size_t out_len);
+
+// Chaining value of a subtree covering n > 0 bytes starting at chunk number
+// chunk.  Unless the subtree is the rightmost one, n must be a power of two
+// number of chunks.
+extern void blake3_subtree(uint8_t cv[BLAKE3_CV_LEN], const void *p, size_t n, uint64_t chunk);
+
+// Hash count >= 2 subtree chaining values into out_len <= BLAKE3_BLOCK_LEN
+// bytes.  The subtrees must all cover the same power of two number of chunks,
+// except that the last may be shorter.  cvs are stride bytes apart.
+extern void blake3_root(uint8_t *out, size_t out_len, const uint8_t *cvs, size_t stride, size_t count);
+
+#endif
@@ -0,0 +1,153 @@
+// A content addressed store of file contents
+
+#include "content_store.h"
+#include "stat_cache.h"
+#include "real_call.h"
+#include "env.h"
+#include "util.h"
+#include <errno.h>
+
+// path = "waitless_dir/content/hash[0:2]/hash".  Returns the length of the
+// directory prefix "waitless_dir/content/".
+static int object_path(char path[PATH_MAX], const struct hash *contents_hash)
+{
+    if (!waitless_env->dir)
+        die("WAITLESS_DIR not set");
+    int n = waitless_env->content_prefix_length;
+    if (n + 3 + SHOW_HASH_SIZE > PATH_MAX)
+        die("WAITLESS_DIR is too long: %d", n);
+
+    memcpy(path, waitless_env->content_prefix, n);
+    show_hash(path+n+3, SHOW_HASH_SIZE, contents_hash);
+    memcpy(path+n, path+n+3, 2);
+    path[n+2] = '/';
+    return n;
+}
+
+// Copy the entire contents of src to dst starting from the current offsets
+static int copy_fd(int dst, int src)
+{
+    char buffer[64*1024];
+    for (;;) {
+        ssize_t n = read(src, buffer, sizeof(buffer));
+        if (n < 0)
+            return 0;
+        else if (!n)
+            return 1;
+        char *p = buffer;
+        while (n) {
+            ssize_t w = write(dst, p, n);
+            if (w < 0)
+                return 0;
+            p += w;
+            n -= w;
+        }
+    }
+}
+
+int content_exists(const struct hash *contents_hash)
+{
+    char path[PATH_MAX];
+    object_path(path, contents_hash);
+    struct stat st;
+    return real_stat(path, &st) == 0;
+}
+
+int64_t content_size(const struct hash *contents_hash)
+{
+    char path[PATH_MAX];
+    object_path(path, contents_hash);
+    struct stat st;
+    return real_stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+void content_remove(const struct hash *contents_hash)
+{
+    char path[PATH_MAX];
+    object_path(path, contents_hash);
+    if (unlink(path) < 0 && errno != ENOENT)
+        die("content_remove: unlink(\"%s\") failed: %s", path, strerror(errno));
+}
+
+void content_store_fd(const struct hash *contents_hash, int fd)
+{
+    char path[PATH_MAX];
+    int n = object_path(path, contents_hash);
+
+    // Identical contents are stored only once
+    struct stat st;
+    if (real_stat(path, &st) == 0)
+        return;
+
+    // Write to a temporary file in the object's directory and rename it into
+    // place, so that readers never see partial objects.
+    char tmp[PATH_MAX];
+    memcpy(tmp, path, n+3);
+    strcpy(tmp+n+3, "tmp.XXXXXX");
+    int tmp_fd = mkstemp(tmp);
+    if (tmp_fd < 0 && errno == ENOENT) {
+        // Create the necessary directory components
+        tmp[n-1] = 0;
+        if (mkdir(tmp, 0755) < 0 && errno != EEXIST)
+            die("mkdir(\"%s\") failed: %s", tmp, strerror(errno));
+        tmp[n-1] = '/';
+        tmp[n+2] = 0;
+        if (mkdir(tmp, 0755) < 0 && errno != EEXIST)
+            die("mkdir(\"%s\") failed: %s", tmp, strerror(errno));
+        tmp[n+2] = '/';
+        strcpy(tmp+n+3, "tmp.XXXXXX");
+        tmp_fd = mkstemp(tmp);
+    }
+    if (tmp_fd < 0)
+        die("content_store_fd: can't create %s: %s", tmp, strerror(errno));
+
+    // Preserve permission bits so that restored executables stay executable
+    if (real_fstat(fd, &st) < 0)
+        die("content_store_fd: fstat failed: %s", strerror(errno));
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        die("content_store_fd: lseek failed: %s", strerror(errno));
+    if (!copy_fd(tmp_fd, fd) || fchmod(tmp_fd, st.st_mode & 0777) < 0)
+        die("content_store_fd: copy to %s failed: %s", tmp, strerror(errno));
+    if (real_close(tmp_fd) < 0)
+        die("content_store_fd: close failed: %s", strerror(errno));
+
+    // If another process stored the same contents in the meantime, the rename
+    // harmlessly replaces one copy with another.
+    if (real_rename(tmp, path) < 0)
+        die("content_store_fd: rename to %s failed: %s", path, strerror(errno));
+}
+
+int content_restore(const struct hash *contents_hash, const char *path, const struct hash *path_hash)
+{
+    char object[PATH_MAX];
+    object_path(object, contents_hash);
+    int fd = real_open(object, O_RDONLY, 0);
+    if (fd < 0)
+        return 0;
+
+    // Write next to path and rename into place, so that path never has
+    // partial contents.
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.waitless.XXXXXX", path) >= sizeof(tmp)) {
+        real_close(fd);
+        return 0;
+    }
+    int tmp_fd = mkstemp(tmp);
+    if (tmp_fd < 0) {
+        real_close(fd);
+        return 0;
+    }
+
+    struct stat st;
+    if (real_fstat(fd, &st) < 0 || !copy_fd(tmp_fd, fd) || fchmod(tmp_fd, st.st_mode & 0777) < 0)
+        die("content_restore: copy to %s failed: %s", tmp, strerror(errno));
+    real_close(fd);
+    if (real_rename(tmp, path) < 0)
+        die("content_restore: rename to %s failed: %s", path, strerror(errno));
+
+    // The renamed file keeps the inode and mtime of tmp_fd, so we can record
+    // the known hash instead of hashing the file again.
+    stat_cache_record(contents_hash, tmp_fd, path_hash);
+    real_close(tmp_fd);
+    return 1;
+}
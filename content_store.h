@@ -0,0 +1,38 @@
+// A content addressed store of file contents
+
+#ifndef __content_store_h__
+#define __content_store_h__
+
+#include "hash.h"
+
+/*
+ * The content store keeps a copy of every file written under waitless, named
+ * by the hash of its contents in the same layout as the inverse map:
+ *
+ *     $WAITLESS_DIR/content/<hash[0:2]>/<hash>
+ *
+ * Since objects are named by contents, identical outputs are stored once no
+ * matter which paths or runs produced them.  Replay uses the store to bring
+ * back outputs that have since been deleted or overwritten.
+ */
+
+// Store the contents of fd under contents_hash unless they are already
+// present.  contents_hash must be the hash of the entire file, and the file
+// offset of fd is clobbered.
+extern void content_store_fd(const struct hash *contents_hash, int fd);
+
+// Check whether contents_hash is present in the store.
+extern int content_exists(const struct hash *contents_hash);
+
+// Atomically replace path with the stored contents_hash, updating the stat
+// cache entry for path_hash.  Returns false if the contents are not present
+// or path can't be written (e.g., because its directory is missing).
+extern int content_restore(const struct hash *contents_hash, const char *path, const struct hash *path_hash);
+
+// Size of the stored contents_hash in bytes, or -1 if it is not present.
+extern int64_t content_size(const struct hash *contents_hash);
+
+// Remove contents_hash from the store if it is present.
+extern void content_remove(const struct hash *contents_hash);
+
+#endif
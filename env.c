@@ -2,11 +2,63 @@
 
 #include "env.h"
 #include "real_call.h"
+#include "util.h"
 
-// TODO: this routine is extremely slow.  The most natural way to speed it up
-// is probably to have a global "initialize" function that does the environment
-// variable lookups once.
-int is_verbose()
+static struct waitless_env env;
+const struct waitless_env *const waitless_env = &env;
+
+// Copies of the variables, since setenv may free the originals
+static char dir[PATH_MAX], snapshot[PATH_MAX], process[PATH_MAX];
+static char dir_prefix[PATH_MAX], content_prefix[PATH_MAX];
+
+static const char *copy_env(char buffer[PATH_MAX], const char *name)
+{
+    const char *value = getenv(name);
+    if (!value)
+        return 0;
+    if (strlcpy(buffer, value, PATH_MAX) >= PATH_MAX)
+        die("%s is too long: %s", name, value);
+    return buffer;
+}
+
+__attribute__((constructor)) static void env_init()
+{
+    env.dir = copy_env(dir, WAITLESS_DIR);
+    env.snapshot = copy_env(snapshot, WAITLESS_SNAPSHOT);
+    env.process = copy_env(process, WAITLESS_PROCESS);
+    env.verbose = getenv(WAITLESS_VERBOSE) != 0;
+    env.force = getenv(WAITLESS_FORCE) != 0;
+
+    env.dir_prefix = dir_prefix;
+    env.content_prefix = content_prefix;
+    if (env.dir) {
+        env.dir_prefix_length = snprintf(dir_prefix, PATH_MAX, "%s/", dir);
+        env.content_prefix_length = snprintf(content_prefix, PATH_MAX, "%s/content/", dir);
+        if (env.content_prefix_length >= PATH_MAX)
+            die("WAITLESS_DIR is too long: %s", dir);
+    }
+    else {
+        dir_prefix[0] = content_prefix[0] = 0;
+        env.dir_prefix_length = env.content_prefix_length = 0;
+    }
+}
+
+void env_set(const char *name, const char *value)
+{
+    if (setenv(name, value, 1) < 0)
+        die("setenv %s failed", name);
+    env_init();
+}
+
+const char *waitless_path(const char *name)
 {
-    return getenv(WAITLESS_VERBOSE) != 0;
+    static char path[PATH_MAX];
+    if (!env.dir)
+        die("WAITLESS_DIR not set");
+    int n = strlen(name);
+    if (env.dir_prefix_length + n >= PATH_MAX)
+        die("path too long: %s%s", env.dir_prefix, name);
+    memcpy(path, env.dir_prefix, env.dir_prefix_length);
+    memcpy(path + env.dir_prefix_length, name, n + 1);
+    return path;
 }
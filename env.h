@@ -7,10 +7,37 @@ static const char WAITLESS_DIR[] = "WAITLESS_DIR";
 static const char WAITLESS_SNAPSHOT[] = "WAITLESS_SNAPSHOT";
 static const char WAITLESS_PROCESS[] = "WAITLESS_PROCESS";
 static const char WAITLESS_VERBOSE[] = "WAITLESS_VERBOSE";
+static const char WAITLESS_FORCE[] = "WAITLESS_FORCE";
 
-// TODO: this routine is extremely slow.  The most natural way to speed it up
-// is probably to have a global "initialize" function that does the environment
-// variable lookups once.
-extern int is_verbose();
+/*
+ * The environment variables above, read once when the process starts (by a
+ * constructor in env.c) so that stubs never have to scan the environment.
+ * Strings are null if the variable is unset.  The waitless executable changes
+ * its own environment before starting the build, so it must do so through
+ * env_set.
+ */
+struct waitless_env
+{
+    const char *dir;
+    const char *snapshot;
+    const char *process;
+    int verbose;
+    int force;
+
+    // "$WAITLESS_DIR/" and "$WAITLESS_DIR/content/", or empty if dir is null
+    const char *dir_prefix;
+    const char *content_prefix;
+    int dir_prefix_length;
+    int content_prefix_length;
+};
+
+extern const struct waitless_env *const waitless_env;
+
+// Set an environment variable and update waitless_env to match
+extern void env_set(const char *name, const char *value);
+
+// Path of name inside WAITLESS_DIR, in a static buffer.  Dies if WAITLESS_DIR
+// is not set.
+extern const char *waitless_path(const char *name);
 
 #endif
@@ -12,18 +12,47 @@ static void check_fd(int fd)
         die("fd_map: invalid fd %d", fd);
 }
 
+// Make fd's entries in map and cloexec meaningful
+static void extend(struct fd_map *fds, int fd)
+{
+    for (; fds->fds <= fd; fds->fds++) {
+        fds->map[fds->fds] = 0;
+        fds->cloexec[fds->fds] = 0;
+    }
+}
+
+static int slot(const struct fd_map *fds, int fd)
+{
+    return fd < fds->fds ? fds->map[fd] : 0;
+}
+
+void fd_map_copy(struct fd_map *to, const struct fd_map *from)
+{
+    to->fds = from->fds;
+    to->slots = from->slots;
+    memcpy(to->map, from->map, from->fds);
+    memcpy(to->cloexec, from->cloexec, from->fds);
+    memcpy(to->info + 1, from->info + 1, from->slots * sizeof(struct fd_info));
+}
+
 void fd_map_open(int fd, int flags, const struct hash *path_hash)
 {
     check_fd(fd);
     struct process *process = lock_process();
-    if (process->fds.map[fd])
+    if (slot(&process->fds, fd))
         die("fd_map_open: reopening open fd %d", fd);
-    // Find a free info slot.  Since map and info are the
-    // same size, at least one free entry exists.
+    // Find a free info slot, using a new one only if all are taken.  Since
+    // map and info are the same size, one is free unless every other fd is
+    // open on a distinct file.
     int i;
-    for (i = 1; ; i++)
+    for (i = 1; i <= process->fds.slots; i++)
         if (!process->fds.info[i].count)
             break;
+    if (i == MAX_FDS)
+        die("fd_map_open: more than %d open files", MAX_FDS - 1);
+    if (i > process->fds.slots)
+        process->fds.slots = i;
+    extend(&process->fds, fd);
     process->fds.map[fd] = i;
     process->fds.cloexec[fd] = 0;
     struct fd_info *info = process->fds.info + i;
@@ -40,12 +69,13 @@ void fd_map_dup2(int fd, int fd2)
     check_fd(fd);
     check_fd(fd2);
     struct process *process = lock_process();
-    int slot = process->fds.map[fd];
-    if (slot) {
-        if (process->fds.map[fd2])
+    int i = slot(&process->fds, fd);
+    if (i) {
+        if (slot(&process->fds, fd2))
             die("fd_map_dup2(%d, %d): %d is open", fd, fd2, fd2);
-        process->fds.map[fd2] = slot;
-        process->fds.info[slot].count++;
+        extend(&process->fds, fd2);
+        process->fds.map[fd2] = i;
+        process->fds.info[i].count++;
     }
     unlock_process();
 }
@@ -54,15 +84,15 @@ struct fd_info *fd_map_find(int fd)
 {
     check_fd(fd);
     struct process *process = process_info();
-    int slot = process->fds.map[fd];
-    return slot ? process->fds.info + slot : 0;
+    int i = slot(&process->fds, fd);
+    return i ? process->fds.info + i : 0;
 }
 
 void fd_map_set_cloexec(int fd, int cloexec)
 {
     check_fd(fd);
     struct process *process = lock_process();
-    if (process->fds.map[fd])
+    if (slot(&process->fds, fd))
         process->fds.cloexec[fd] = cloexec;
     unlock_process();
 }
@@ -71,9 +101,9 @@ void fd_map_close(int fd)
 {
     check_fd(fd);
     struct process *process = lock_process();
-    int slot = process->fds.map[fd];
-    if (slot) {
-        process->fds.info[slot].count--;
+    int i = slot(&process->fds, fd);
+    if (i) {
+        process->fds.info[i].count--;
         process->fds.map[fd] = 0;
     }
     unlock_process();
@@ -84,10 +114,10 @@ void fd_map_dump()
     struct process *process = lock_process();
     fdprintf(STDERR_FILENO, "fd_map dump %d:\n", process->pid);
     int fd;
-    for (fd = 0; fd < MAX_FDS; fd++) {
-        int slot = process->fds.map[fd];
-        if (slot) {
-            struct fd_info *info = process->fds.info + slot;
+    for (fd = 0; fd < process->fds.fds; fd++) {
+        int i = process->fds.map[fd];
+        if (i) {
+            struct fd_info *info = process->fds.info + i;
             char buffer[1024];
             if (info->flags & WO_PIPE)
                 strcpy(buffer, "<pipe>");
@@ -18,13 +18,23 @@ struct fd_info
     struct hash path_hash;
 };
 
+// info is indexed by map, with slot zero unused.  Byte indices keep map and
+// cloexec small without limiting how many distinct files can be open.  Only
+// the first fds entries of map and cloexec and info[1..slots] mean anything;
+// the rest are cleared as they come into use, so a process entry only touches
+// as much of its fd_map as the process needs.
 struct fd_map
 {
-    int map[MAX_FDS];
-    int cloexec[MAX_FDS]; // close-on-exec flags
+    int fds;   // one more than the highest fd ever mapped
+    int slots; // highest info slot ever used
+    uint8_t map[MAX_FDS];
+    uint8_t cloexec[MAX_FDS]; // close-on-exec flags
     struct fd_info info[MAX_FDS];
 };
 
+// Copy only the meaningful part of an fd_map
+extern void fd_map_copy(struct fd_map *to, const struct fd_map *from);
+
 extern void fd_map_open(int fd, int flags, const struct hash *path_hash);
 
 extern void fd_map_dup2(int fd, int fd2);
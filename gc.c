@@ -0,0 +1,282 @@
+// Garbage collection of stored history
+
+#include "gc.h"
+#include "subgraph.h"
+#include "shared_map.h"
+#include "stat_cache.h"
+#include "inverse_map.h"
+#include "content_store.h"
+#include "real_call.h"
+#include "env.h"
+#include "util.h"
+#include <errno.h>
+#include <dirent.h>
+
+#define DAY (24*60*60)
+
+// History older than this is lumped together when applying the budget
+#define MAX_DAYS 1024
+
+/*
+ * We collect in two passes over the subgraph.  The first pass charges every
+ * node for what it costs on disk: its own subgraph entry, plus the preimages,
+ * stat cache entries, and stored files it refers to, each charged once to the
+ * most recent node that uses it.  This tells us how many bytes each day of
+ * history takes, so that we can pick the oldest age to keep given the budget.
+ * The second pass compacts the subgraph down to nodes within that age and
+ * marks everything the survivors refer to.  Finally, we sweep the content
+ * store for objects that aren't marked.  The marks live in a temporary shared
+ * map, since the sets involved can be large.
+ */
+
+// What a node needs of a hash it refers to
+#define MARK_PATH 1     // a path hash: keep its preimage and stat cache entry
+#define MARK_INVERSE 2  // keep the preimage
+#define MARK_CONTENT 4  // keep the stored contents
+
+// Costs charged for a hash in the first pass, so that each is charged once
+#define CHARGE_PREIMAGE 1
+#define CHARGE_STAT 2
+#define CHARGE_CONTENT 4
+
+struct mark
+{
+    uint32_t flags;   // MARK_* needed by surviving nodes
+    uint32_t charged; // CHARGE_* already counted in bytes
+    uint32_t newest;  // most recent use of a node referring to this hash
+    uint64_t bytes;   // what keeping this hash costs across all stores
+};
+
+static struct shared_map marks = { "gc.marks", sizeof(struct mark), 1<<15 };
+
+static uint32_t now;
+static int cutoff_age;
+
+static int age(uint32_t used)
+{
+    return used < now ? (now - used) / DAY : 0;
+}
+
+static struct mark *lookup_mark(const struct hash *hash)
+{
+    struct mark *m;
+    shared_map_lock(&marks);
+    shared_map_lookup(&marks, hash, (void**)&m, 1);
+    return m;
+}
+
+// Call f on each hash the node refers to, with what it needs of the hash
+typedef void (*ref_visitor)(const struct hash *hash, uint32_t what, uint32_t used);
+
+static void visit_refs(enum action_type type, const struct hash *data, uint32_t used, ref_visitor f)
+{
+    switch (type) {
+        case SG_STAT:
+        case SG_READ:
+            f(data, MARK_PATH, used);
+            break;
+        case SG_WRITE: {
+            struct hash hashes[2];
+            if (inverse_hash_memory(data, hashes, 2*sizeof(struct hash)) != 2*sizeof(struct hash))
+                die("gc: corrupt write node");
+            f(data, MARK_INVERSE, used);
+            f(hashes, MARK_PATH, used);
+            f(hashes+1, MARK_CONTENT, used);
+            break;
+        }
+        case SG_SEARCH:
+            f(data, MARK_INVERSE, used);
+            break;
+        case SG_EXEC: {
+            // Keep the stat cache entry for the program as well
+            char buffer[EXEC_DATA_SIZE];
+            struct exec_info info;
+            struct hash program;
+            subgraph_exec_info(&info, buffer, data);
+            hash_string(&program, path_join(info.cwd, info.path));
+            f(data, MARK_INVERSE, used);
+            f(&program, MARK_PATH, used);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static uint64_t node_bytes, stat_bytes;
+static uint64_t day_bytes[MAX_DAYS+1];
+
+static void charge(const struct hash *hash, uint32_t what, uint32_t used)
+{
+    uint32_t charges = what == MARK_PATH ? CHARGE_PREIMAGE | CHARGE_STAT
+                     : what == MARK_INVERSE ? CHARGE_PREIMAGE : CHARGE_CONTENT;
+    struct mark *m = lookup_mark(hash);
+    charges &= ~m->charged;
+    m->charged |= charges;
+    m->newest = max(m->newest, used);
+    shared_map_unlock(&marks);
+
+    // Find the costs outside the lock, since they may take system calls
+    uint64_t bytes = 0;
+    if (charges & CHARGE_PREIMAGE)
+        bytes += inverse_map_bytes(hash);
+    if (charges & CHARGE_STAT)
+        bytes += stat_bytes;
+    if (charges & CHARGE_CONTENT)
+        bytes += max(content_size(hash), 0);
+    if (bytes) {
+        m = lookup_mark(hash);
+        m->bytes += bytes;
+        shared_map_unlock(&marks);
+    }
+}
+
+static int charge_node(const struct hash *name, enum action_type type, const struct hash *data, uint32_t used)
+{
+    day_bytes[min(age(used), MAX_DAYS)] += node_bytes;
+    visit_refs(type, data, used, charge);
+    return 0;
+}
+
+static int count_bytes(const struct hash *hash, void *value)
+{
+    struct mark *m = value;
+    day_bytes[min(age(m->newest), MAX_DAYS)] += m->bytes;
+    return 0;
+}
+
+static void keep(const struct hash *hash, uint32_t what, uint32_t used)
+{
+    struct mark *m = lookup_mark(hash);
+    m->flags |= what;
+    shared_map_unlock(&marks);
+}
+
+static int keep_node(const struct hash *name, enum action_type type, const struct hash *data, uint32_t used)
+{
+    if (age(used) > cutoff_age)
+        return 0;
+    visit_refs(type, data, used, keep);
+    return 1;
+}
+
+static int keep_preimage(const struct hash *hash)
+{
+    struct mark m;
+    return shared_map_read(&marks, hash, &m) && m.flags & (MARK_PATH | MARK_INVERSE);
+}
+
+static int keep_stat(const struct hash *path_hash)
+{
+    struct mark m;
+    return shared_map_read(&marks, path_hash, &m) && m.flags & MARK_PATH;
+}
+
+static int removed;
+static uint64_t removed_bytes;
+
+// Is name a full hash as written by show_hash?
+static int is_hash_name(const char *name)
+{
+    return strlen(name) == SHOW_HASH_SIZE - 1 && strspn(name, "0123456789abcdef") == SHOW_HASH_SIZE - 1;
+}
+
+// Remove every object in the content store that no surviving node refers to,
+// along with temporary files left by interrupted stores
+static void sweep_contents()
+{
+    char path[PATH_MAX];
+    int n = strlcpy(path, waitless_env->content_prefix, sizeof(path));
+    if (n + 3 + SHOW_HASH_SIZE > sizeof(path))
+        die("WAITLESS_DIR is too long: %d", n);
+    DIR *top = opendir(path);
+    if (!top)
+        return;
+
+    struct dirent *d, *e;
+    while ((d = readdir(top))) {
+        if (strlen(d->d_name) != 2 || !strcmp(d->d_name, ".."))
+            continue;
+        strcpy(path + n, d->d_name);
+        DIR *dir = opendir(path);
+        if (!dir)
+            continue;
+        path[n+2] = '/';
+        while ((e = readdir(dir))) {
+            struct hash hash;
+            struct mark m;
+            if (is_hash_name(e->d_name)) {
+                read_hash(&hash, e->d_name);
+                if (shared_map_read(&marks, &hash, &m) && m.flags & MARK_CONTENT)
+                    continue;
+            }
+            else if (!startswith(e->d_name, "tmp."))
+                continue;
+
+            struct stat st;
+            strcpy(path + n + 3, e->d_name);
+            if (real_lstat(path, &st) < 0)
+                continue;
+            if (unlink(path) < 0 && errno != ENOENT)
+                die("gc: unlink(\"%s\") failed: %s", path, strerror(errno));
+            removed++;
+            removed_bytes += st.st_size;
+        }
+        closedir(dir);
+    }
+    closedir(top);
+}
+
+// Size of a file in the waitless directory, or zero if it doesn't exist
+static uint64_t file_bytes(const char *name)
+{
+    struct stat st;
+    return real_stat(waitless_path(name), &st) == 0 ? st.st_size : 0;
+}
+
+void gc(int max_age, uint64_t budget)
+{
+    char marks_path[PATH_MAX];
+    strlcpy(marks_path, waitless_path(marks.name), sizeof(marks_path));
+    unlink(marks_path);
+    shared_map_init(&marks, real_open(marks_path, O_CREAT | O_WRONLY, 0644));
+    shared_map_open(&marks, marks_path);
+    now = time(0);
+
+    // Find what each day of history costs
+    node_bytes = subgraph_node_bytes();
+    stat_bytes = stat_cache_entry_bytes();
+    memset(day_bytes, 0, sizeof(day_bytes));
+    subgraph_iter(charge_node);
+    shared_map_lock(&marks);
+    shared_map_iter(&marks, count_bytes);
+    shared_map_unlock(&marks);
+
+    // Pick the oldest age to keep.  The PATH search memo isn't history, but
+    // it takes space all the same.
+    cutoff_age = max_age;
+    if (budget) {
+        uint64_t total = file_bytes("search_path");
+        int d;
+        for (d = 0; d <= min(max_age, MAX_DAYS); d++) {
+            total += day_bytes[d];
+            if (total > budget) {
+                cutoff_age = max(d - 1, 0);
+                break;
+            }
+        }
+    }
+
+    // Compact everything down to what the surviving nodes need
+    int nodes = subgraph_compact(keep_node);
+    int preimages = inverse_map_compact(keep_preimage);
+    int stats = stat_cache_compact(keep_stat);
+    sweep_contents();
+
+    munmap(marks.addr, marks.size);
+    unlink(marks_path);
+
+    fdprintf(STDOUT_FILENO, "gc: kept %d days of history: %d nodes, %d preimages, %d stat cache entries\n",
+        cutoff_age + 1, nodes, preimages, stats);
+    fdprintf(STDOUT_FILENO, "gc: removed %d stored files (%d MB)\n", removed, (int)(removed_bytes >> 20));
+}
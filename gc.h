@@ -0,0 +1,25 @@
+// Garbage collection of stored history
+
+#ifndef __gc_h__
+#define __gc_h__
+
+#include <stdint.h>
+
+/*
+ * The subgraph, stat cache, inverse map, and content store only grow as
+ * waitless runs.  gc forgets subgraph nodes that haven't been created or
+ * replayed within max_age days, and then keeps only the preimages, stat cache
+ * entries, and stored file contents that surviving nodes still refer to.  Any
+ * other object in the content store is removed.
+ *
+ * If budget is nonzero, gc also forgets the least recently used days of
+ * history until everything waitless stores (the subgraph, inverse map, stat
+ * cache, PATH search memo, and stored file contents) fits within budget bytes.
+ * The most recent day is always kept.
+ *
+ * gc must not run concurrently with any other waitless process; waitless -g
+ * enforces this with a lock in WAITLESS_DIR (see waitless.c).
+ */
+extern void gc(int max_age, uint64_t budget);
+
+#endif
@@ -1,19 +1,24 @@
 // A very thin wrapper around a cryptographic hash function
 
 #include <string.h>
-#include "skein.h"
 #include "hash.h"
 #include "util.h"
 #include "real_call.h"
+#include "endian.h"
 #include <errno.h>
 
-static Skein_512_Ctxt_t context;
+
+#if HASH_BACKEND == HASH_SKEIN
+const struct hash_backend *const hash_backend = &hash_skein;
+#elif HASH_BACKEND == HASH_BLAKE3
+const struct hash_backend *const hash_backend = &hash_blake3;
+#else
+#error "unknown HASH_BACKEND"
+#endif
 
 void hash_memory(struct hash *hash, const void *p, size_t n)
 {
-    Skein_512_Init(&context, 8*sizeof(struct hash));
-    Skein_512_Update(&context, p, n);
-    Skein_512_Final(&context, (uint8_t*)hash);
+    hash_backend->memory(hash, p, n);
 }
 
 void hash_string(struct hash *hash, const char *s)
@@ -21,19 +26,159 @@ void hash_string(struct hash *hash, const char *s)
     hash_memory(hash, s, strlen(s));
 }
 
-void hash_fd(struct hash *hash, int fd)
+void hash_init(struct hash_context *context)
+{
+    context->backend = hash_backend;
+    hash_backend->init(context->state);
+}
+
+void hash_update(struct hash_context *context, const void *p, size_t n)
+{
+    context->backend->update(context->state, p, n);
+}
+
+void hash_final(struct hash_context *context, struct hash *hash)
+{
+    context->backend->final(context->state, hash);
+}
+
+void hash_memory_many(size_t n, struct hash hashes[], const void *const p[], const size_t len[])
 {
-    Skein_512_Init(&context, 8*sizeof(struct hash));
-    char buffer[16*1024];
-    for (;;) {
-        ssize_t len = read(fd, buffer, sizeof(buffer));
-        if (len < 0)
+    hash_backend->memory_many(n, hashes, p, len);
+}
+
+void hash_tree_leaf(uint8_t node[HASH_TREE_NODE], uint64_t i, const void *p, size_t n)
+{
+    hash_backend->tree_leaf(node, i, p, n);
+}
+
+void hash_tree_root(struct hash *hash, uint8_t *nodes, size_t count)
+{
+    hash_backend->tree_root(hash, nodes, count);
+}
+
+/*
+ * hash_fd reads large inputs a leaf at a time into a page aligned buffer,
+ * which also keeps the number of system calls down.  Files smaller than a
+ * leaf get a buffer sized to fit, and readahead hints are only worth a system
+ * call from LARGE_FILE up.  We deliberately avoid mmapping the file itself:
+ * hashing often runs inside traced processes, and a file truncated underneath
+ * a mapping would kill them with SIGBUS.
+ */
+#define SMALL_READ (16*1024)
+#define LARGE_FILE (64*1024)
+
+#ifdef __APPLE__
+#define F_RDAHEAD 45
+#else
+#define POSIX_FADV_SEQUENTIAL 2
+extern int posix_fadvise(int fd, off_t offset, off_t len, int advice);
+#endif
+
+// Read until n bytes or end of file, returning the number of bytes read
+static size_t read_full(int fd, void *p, size_t n)
+{
+    size_t done = 0;
+    while (done < n) {
+        ssize_t len = read(fd, (char*)p + done, n - done);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
             die("read failed in hash_fd: %s", strerror(errno));
-        else if(len == 0)
+        }
+        else if (len == 0)
             break;
-        Skein_512_Update(&context, (uint8_t*)buffer, len);
+        done += len;
     }
-    Skein_512_Final(&context, (uint8_t*)hash);
+    return done;
+}
+
+void *hash_map_buffer(size_t size)
+{
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED)
+        die("hash: mmap of %lu bytes failed: %s", (unsigned long)size, strerror(errno));
+    return p;
+}
+
+void hash_fd_backend(const struct hash_backend *backend, struct hash *hash, int fd)
+{
+    // Most files are small, so try a single small read first
+    char small[SMALL_READ];
+    size_t n = read_full(fd, small, sizeof(small));
+    if (n < sizeof(small)) {
+        backend->memory(hash, small, n);
+        return;
+    }
+
+    // Size the buffer to the file if it is smaller than a leaf.  The extra
+    // byte tells us whether it has grown since the fstat.
+    struct stat st;
+    size_t size = 2 * HASH_TREE_LEAF;
+    if (real_fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+        && st.st_size >= n && st.st_size < HASH_TREE_LEAF)
+        size = st.st_size + 1;
+
+    // Tell the kernel to read ahead aggressively
+    if (size >= LARGE_FILE) {
+#ifdef __APPLE__
+        real_fcntl(fd, F_RDAHEAD, 1);
+#else
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+
+    uint8_t *buffer = hash_map_buffer(size);
+    memcpy(buffer, small, n);
+    n += read_full(fd, buffer + n, min(size, HASH_TREE_LEAF) - n);
+    if (n < min(size, HASH_TREE_LEAF)) {
+        backend->memory(hash, buffer, n);
+        munmap(buffer, size);
+        return;
+    }
+    if (size < 2 * HASH_TREE_LEAF) {
+        // The file grew, so carry on with a full size buffer
+        uint8_t *more = hash_map_buffer(2 * HASH_TREE_LEAF);
+        memcpy(more, buffer, n);
+        munmap(buffer, size);
+        buffer = more;
+        n += read_full(fd, buffer + n, HASH_TREE_LEAF - n);
+    }
+
+    // Look for a second leaf
+    size_t next = n < HASH_TREE_LEAF ? 0 : read_full(fd, buffer + HASH_TREE_LEAF, HASH_TREE_LEAF);
+    if (!next) {
+        backend->memory(hash, buffer, n);
+        munmap(buffer, 2 * HASH_TREE_LEAF);
+        return;
+    }
+
+    // Hash leaves as we go, growing the array of leaf outputs as needed
+    size_t count = 0, capacity = 1024;
+    uint8_t *nodes = hash_map_buffer(capacity * HASH_TREE_NODE);
+    backend->tree_leaf(nodes, count++, buffer, n);
+    uint8_t *leaf = buffer + HASH_TREE_LEAF;
+    for (n = next; n; n = read_full(fd, leaf, HASH_TREE_LEAF)) {
+        if (count == capacity) {
+            uint8_t *more = hash_map_buffer(2 * capacity * HASH_TREE_NODE);
+            memcpy(more, nodes, capacity * HASH_TREE_NODE);
+            munmap(nodes, capacity * HASH_TREE_NODE);
+            nodes = more;
+            capacity *= 2;
+        }
+        backend->tree_leaf(nodes + count * HASH_TREE_NODE, count, leaf, n);
+        count++;
+        if (n < HASH_TREE_LEAF)
+            break;
+    }
+    munmap(buffer, 2 * HASH_TREE_LEAF);
+    backend->tree_root(hash, nodes, count);
+    munmap(nodes, capacity * HASH_TREE_NODE);
+}
+
+void hash_fd(struct hash *hash, int fd)
+{
+    hash_fd_backend(hash_backend, hash, fd);
 }
 
 static inline char show_nibble(unsigned char n)
@@ -1,7 +1,10 @@
 // A very thin wrapper around a cryptographic hash function
 
-// Currently we use the Skein hash function: http://www.skein-hash.info
-// Changing the hash function used by waitless should only require changing this file
+// The hash function is chosen at compile time with -DHASH_BACKEND=...
+// (dmk passes through $HASH_BACKEND).  The default is Skein-512
+// (http://www.skein-hash.info, hash_skein.c), and BLAKE3 (hash_blake3.c) is
+// the alternative.  Shared maps record which backend wrote them, so stores
+// from different backends never mix.
 
 #ifndef __hash_h__
 #define __hash_h__
@@ -14,6 +17,12 @@ struct hash
     uint32_t data[4];
 };
 
+#define HASH_SKEIN 1
+#define HASH_BLAKE3 2
+#ifndef HASH_BACKEND
+#define HASH_BACKEND HASH_SKEIN
+#endif
+
 static inline int hash_is_null(const struct hash *p)
 {
     int i;
@@ -37,15 +46,71 @@ static inline int hash_equal(const struct hash *p, const struct hash *q)
     return !memcmp(p, q, sizeof(struct hash));
 }
 
+// All hashing functions are reentrant and thread safe: contexts live on the
+// stack or in caller supplied storage, never in globals.
+
 // Hash a block of memory.  Input and output are allowed to overlap.
 extern void hash_memory(struct hash *hash, const void *p, size_t n);
 
 // Hash a string
 extern void hash_string(struct hash *hash, const char *s);
 
-// Hash of the contents of a file descriptor
+// Hash n independent blocks of memory, equivalent to n calls to hash_memory
+// but faster for many short inputs.  Outputs must not overlap inputs.
+extern void hash_memory_many(size_t n, struct hash hashes[], const void *const p[], const size_t len[]);
+
+// Incremental hashing into a caller supplied context.  hash_final gives the
+// same result as hash_memory on the concatenation of everything passed to
+// hash_update.  Contexts are plain memory: they may be copied to hash several
+// inputs with a common prefix, and need no cleanup.
+struct hash_context
+{
+    const struct hash_backend *backend;
+    uint64_t state[256]; // large enough for any backend's state
+};
+
+extern void hash_init(struct hash_context *context);
+extern void hash_update(struct hash_context *context, const void *p, size_t n);
+extern void hash_final(struct hash_context *context, struct hash *hash);
+
+// Hash of the contents of a file descriptor.  Contents longer than
+// HASH_TREE_LEAF are hashed in tree mode, so with Skein the result differs
+// from hash_memory on the same bytes.  (BLAKE3 is a tree hash already.)
 extern void hash_fd(struct hash *hash, int fd);
 
+// Tree mode internals, shared with hash_parallel.c.  hash_tree_leaf hashes
+// leaf i of an input, and hash_tree_root combines count >= 2 leaf outputs
+// (clobbering them).  Leaf outputs take at most HASH_TREE_NODE bytes.
+#define HASH_TREE_LEAF (1<<20)
+#define HASH_TREE_NODE 64
+extern void hash_tree_leaf(uint8_t node[HASH_TREE_NODE], uint64_t i, const void *p, size_t n);
+extern void hash_tree_root(struct hash *hash, uint8_t *nodes, size_t count);
+
+// The operations each backend provides.  hash_memory and friends use the
+// backend selected by HASH_BACKEND, but all backends are linked in so that
+// they can be compared (see skein -b).
+struct hash_backend
+{
+    const char *name;
+    int id; // HASH_SKEIN, etc.
+    void (*memory)(struct hash *hash, const void *p, size_t n);
+    void (*init)(void *state);
+    void (*update)(void *state, const void *p, size_t n);
+    void (*final)(void *state, struct hash *hash);
+    void (*memory_many)(size_t n, struct hash hashes[], const void *const p[], const size_t len[]);
+    void (*tree_leaf)(uint8_t node[HASH_TREE_NODE], uint64_t i, const void *p, size_t n);
+    void (*tree_root)(struct hash *hash, uint8_t *nodes, size_t count);
+};
+
+extern const struct hash_backend hash_skein, hash_blake3;
+extern const struct hash_backend *const hash_backend;
+
+// hash_fd with a specific backend
+extern void hash_fd_backend(const struct hash_backend *backend, struct hash *hash, int fd);
+
+// Allocate a page aligned buffer with mmap, for use with munmap
+extern void *hash_map_buffer(size_t size);
+
 #define SHOW_HASH_SIZE (2*sizeof(struct hash)+1)
 
 // Convert a hash value to a printable representation and return a pointer
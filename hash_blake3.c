@@ -0,0 +1,57 @@
+// BLAKE3 hash backend (see hash.h)
+
+#include "blake3.h"
+#include "hash.h"
+
+// A leaf is a whole power of two subtree of BLAKE3 chunks, so tree mode gives
+// exactly the BLAKE3 hash of the file
+#if HASH_TREE_LEAF % BLAKE3_CHUNK_LEN || (HASH_TREE_LEAF / BLAKE3_CHUNK_LEN) & (HASH_TREE_LEAF / BLAKE3_CHUNK_LEN - 1) \
+    || BLAKE3_CV_LEN > HASH_TREE_NODE
+#error "tree parameters don't match hash.h"
+#endif
+
+static void blake3_memory(struct hash *hash, const void *p, size_t n)
+{
+    blake3((uint8_t*)hash, sizeof(struct hash), p, n);
+}
+
+_Static_assert(sizeof(struct blake3_hasher) <= sizeof(((struct hash_context*)0)->state),
+    "hash_context is too small for BLAKE3");
+
+static void blake3_hash_init(void *state)
+{
+    blake3_init(state);
+}
+
+static void blake3_hash_update(void *state, const void *p, size_t n)
+{
+    blake3_update(state, p, n);
+}
+
+static void blake3_hash_final(void *state, struct hash *hash)
+{
+    blake3_final(state, (uint8_t*)hash, sizeof(struct hash));
+}
+
+static void blake3_memory_many(size_t n, struct hash hashes[], const void *const p[], const size_t len[])
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        blake3_memory(hashes + i, p[i], len[i]);
+}
+
+static void blake3_tree_leaf(uint8_t node[HASH_TREE_NODE], uint64_t i, const void *p, size_t n)
+{
+    blake3_subtree(node, p, n, i * (HASH_TREE_LEAF / BLAKE3_CHUNK_LEN));
+}
+
+static void blake3_tree_root(struct hash *hash, uint8_t *nodes, size_t count)
+{
+    blake3_root((uint8_t*)hash, sizeof(struct hash), nodes, HASH_TREE_NODE, count);
+}
+
+const struct hash_backend hash_blake3 = {
+    "blake3", HASH_BLAKE3,
+    blake3_memory, blake3_hash_init, blake3_hash_update, blake3_hash_final,
+    blake3_memory_many, blake3_tree_leaf, blake3_tree_root
+};
@@ -0,0 +1,89 @@
+// Multithreaded hashing of large files
+
+#include "hash_parallel.h"
+#include "real_call.h"
+#include "util.h"
+#include <errno.h>
+#include <pthread.h>
+
+extern ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+
+struct job
+{
+    int fd;
+    off_t start;      // offset of the first leaf
+    off_t size;       // bytes to hash
+    size_t count;     // number of leaves
+    uint8_t *nodes;   // leaf outputs
+    size_t next;      // next leaf to hash
+    int short_read;   // did the file shrink underneath us?
+};
+
+static void *worker(void *arg)
+{
+    struct job *job = arg;
+    uint8_t *buffer = hash_map_buffer(HASH_TREE_LEAF);
+    for (;;) {
+        size_t i = __sync_fetch_and_add(&job->next, 1);
+        if (i >= job->count)
+            break;
+        size_t n = min((off_t)HASH_TREE_LEAF, job->size - (off_t)i * HASH_TREE_LEAF), done = 0;
+        while (done < n) {
+            ssize_t len = pread(job->fd, buffer + done, n - done, job->start + (off_t)i * HASH_TREE_LEAF + done);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len < 0)
+                die("read failed in hash_fd_parallel: %s", strerror(errno));
+            if (len == 0)
+                break;
+            done += len;
+        }
+        if (done < n)
+            job->short_read = 1;
+        hash_tree_leaf(job->nodes + i * HASH_TREE_NODE, i, buffer, done);
+    }
+    munmap(buffer, HASH_TREE_LEAF);
+    return 0;
+}
+
+void hash_fd_parallel(struct hash *hash, int fd, int threads)
+{
+    struct stat st;
+    struct job job = { fd };
+    if (threads > 1 && real_fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+        && (job.start = lseek(fd, 0, SEEK_CUR)) >= 0)
+        job.size = st.st_size - job.start;
+    if (job.size <= HASH_TREE_LEAF) {
+        // Not worth splitting up
+        hash_fd(hash, fd);
+        return;
+    }
+
+    job.count = (job.size + HASH_TREE_LEAF - 1) / HASH_TREE_LEAF;
+    job.nodes = hash_map_buffer(job.count * HASH_TREE_NODE);
+    threads = min(threads, (int)min(job.count, (size_t)1024));
+    pthread_t ids[threads];
+    int i;
+    for (i = 0; i < threads; i++)
+        if (pthread_create(ids + i, 0, worker, &job))
+            die("hash_fd_parallel: pthread_create failed");
+    for (i = 0; i < threads; i++)
+        pthread_join(ids[i], 0);
+
+    // If the file changed size while we were hashing, hash_fd decides what
+    // the contents were
+    struct stat after;
+    if (job.short_read || real_fstat(fd, &after) < 0 || after.st_size != st.st_size) {
+        munmap(job.nodes, job.count * HASH_TREE_NODE);
+        if (lseek(fd, job.start, SEEK_SET) < 0)
+            die("lseek failed in hash_fd_parallel: %s", strerror(errno));
+        hash_fd(hash, fd);
+        return;
+    }
+
+    // Leave the offset where hash_fd would
+    if (lseek(fd, st.st_size, SEEK_SET) < 0)
+        die("lseek failed in hash_fd_parallel: %s", strerror(errno));
+    hash_tree_root(hash, job.nodes, job.count);
+    munmap(job.nodes, job.count * HASH_TREE_NODE);
+}
@@ -0,0 +1,13 @@
+// Multithreaded hashing of large files
+
+#ifndef __hash_parallel_h__
+#define __hash_parallel_h__
+
+#include "hash.h"
+
+// Same result as hash_fd, but hashes the leaves of large regular files on up
+// to threads threads.  This needs pthreads, so it lives outside hash.c and is
+// not linked into libwaitless.
+extern void hash_fd_parallel(struct hash *hash, int fd, int threads);
+
+#endif
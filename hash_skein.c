@@ -0,0 +1,101 @@
+// Skein-512 hash backend (the default; see hash.h)
+
+#include <string.h>
+#include "skein.h"
+#include "hash.h"
+#include "util.h"
+#include "endian.h"
+
+// Contexts live on the stack so that hashing is thread safe (see prime.c)
+
+static void skein_memory(struct hash *hash, const void *p, size_t n)
+{
+    Skein_512_Ctxt_t context;
+    Skein_512_Init(&context, 8*sizeof(struct hash));
+    Skein_512_Update(&context, p, n);
+    Skein_512_Final(&context, (uint8_t*)hash);
+}
+
+_Static_assert(sizeof(Skein_512_Ctxt_t) <= sizeof(((struct hash_context*)0)->state),
+    "hash_context is too small for Skein");
+
+static void skein_init(void *state)
+{
+    Skein_512_Init(state, 8*sizeof(struct hash));
+}
+
+static void skein_update(void *state, const void *p, size_t n)
+{
+    Skein_512_Update(state, p, n);
+}
+
+static void skein_final(void *state, struct hash *hash)
+{
+    Skein_512_Final(state, (uint8_t*)hash);
+}
+
+static void skein_memory_many(size_t n, struct hash hashes[], const void *const p[], const size_t len[])
+{
+    Skein_512_Hash_Many(8*sizeof(struct hash), n, (const uint8_t *const *)p, len, (uint8_t*)hashes);
+}
+
+/*
+ * Inputs longer than one leaf are hashed with Skein's tree mode: the input is
+ * split into leaves of HASH_TREE_LEAF bytes which are hashed independently,
+ * and the leaf outputs are hashed together level by level up to a single
+ * root.  This lets hash_fd_parallel hash the leaves of a large file on several
+ * threads while producing the same result as hash_fd.  The tree parameters are
+ * part of the hash value, so changing them changes every stored hash.
+ */
+#define TREE_LEAF_LOG 14 // leaves are 2^14 blocks
+#define TREE_NODE_LOG 14 // interior nodes have 2^14 children
+#define TREE_MAX_LEVEL 0xff
+#define TREE_NODE_BYTES (SKEIN_512_BLOCK_BYTES << TREE_NODE_LOG)
+
+#if (SKEIN_512_BLOCK_BYTES << TREE_LEAF_LOG) != HASH_TREE_LEAF || SKEIN_512_BLOCK_BYTES != HASH_TREE_NODE
+#error "tree parameters don't match hash.h"
+#endif
+
+// Hash one node of the tree at the given level and byte position
+static void tree_node(uint8_t node[HASH_TREE_NODE], int level, uint64_t position, const uint8_t *p, size_t n)
+{
+    Skein_512_Ctxt_t context;
+    Skein_512_InitExt(&context, 8*sizeof(struct hash),
+        SKEIN_CFG_TREE_INFO(TREE_LEAF_LOG, TREE_NODE_LOG, TREE_MAX_LEVEL));
+    Skein_Set_T0_T1(&context, position,
+        SKEIN_T1_FLAG_FIRST | SKEIN_T1_BLK_TYPE_MSG | SKEIN_T1_TREE_LEVEL(level));
+    Skein_512_Update(&context, p, n);
+    Skein_512_Final_Pad(&context, node);
+}
+
+static void skein_tree_leaf(uint8_t node[HASH_TREE_NODE], uint64_t i, const void *p, size_t n)
+{
+    tree_node(node, 1, i * HASH_TREE_LEAF, p, n);
+}
+
+static void skein_tree_root(struct hash *hash, uint8_t *nodes, size_t count)
+{
+    // Each level is hashed in place, which is safe since node j of the next
+    // level is written only after its children have been consumed.
+    int level;
+    for (level = 2; count > 1; level++) {
+        size_t bytes = count * HASH_TREE_NODE, j;
+        for (j = 0; j * TREE_NODE_BYTES < bytes; j++)
+            tree_node(nodes + j * HASH_TREE_NODE, level, j * TREE_NODE_BYTES,
+                nodes + j * TREE_NODE_BYTES, min(bytes - j * TREE_NODE_BYTES, (size_t)TREE_NODE_BYTES));
+        count = j;
+    }
+
+    // Run the output stage from the root
+    Skein_512_Ctxt_t context;
+    Skein_512_InitExt(&context, 8*sizeof(struct hash),
+        SKEIN_CFG_TREE_INFO(TREE_LEAF_LOG, TREE_NODE_LOG, TREE_MAX_LEVEL));
+    memcpy_letoh64(context.X, nodes, HASH_TREE_NODE);
+    Skein_512_Output(&context, (uint8_t*)hash);
+}
+
+const struct hash_backend hash_skein = {
+    "skein512", HASH_SKEIN,
+    skein_memory, skein_init, skein_update, skein_final,
+    skein_memory_many, skein_tree_leaf, skein_tree_root
+};
@@ -1,67 +1,171 @@
 // An inverse map from hashes to preimages
 
 #include "inverse_map.h"
+#include "shared_map.h"
 #include "real_call.h"
 #include "env.h"
 #include "util.h"
+#include "fd_map.h"
 #include <errno.h>
 
-static const char INVERSE[] = "/inverse/";
+/*
+ * Preimages are appended to a single log file, similar to a git packfile:
+ *
+ *     $WAITLESS_DIR/inverse.pack: a sequence of (hash, size, data[size])
+ *     $WAITLESS_DIR/inverse.index: a shared map from hash to (offset, size)
+ *
+ * Each record is appended with a single O_APPEND write, and the index entry
+ * pointing at it is created only after the write completes, so readers never
+ * see a partially written record.  Each process keeps the pack open for
+ * appending, so a new record costs a write and an lseek rather than an open
+ * and close as well.  The pack is mmapped for reading and the
+ * index is lock free, so both remembering a known hash and
+ * inverting a hash normally take no system calls or locks at all.
+ */
+
+static const char PACK[] = "inverse.pack";
+
+struct inverse_record
+{
+    struct hash hash;
+    uint32_t size;
+    char data[0];
+};
+
+struct inverse_entry
+{
+    uint64_t offset; // offset of the preimage data in inverse.pack
+    uint32_t size;
+};
+
+static struct shared_map inverse_index = { "inverse.index", sizeof(struct inverse_entry), 1<<15, 1 };
+
+// Our current read-only mapping of the pack
+static const char *pack_addr;
+static size_t pack_size;
+
+// Our descriptor for appending to the pack.  It lives above the fds fd_map
+// tracks, but the traced program can still close it or dup2 over it, so we
+// check that it is still the file we opened before each append.
+static int pack_fd = -1;
+static dev_t pack_dev;
+static ino_t pack_ino;
+
+void inverse_map_init()
+{
+    int fd = real_open(waitless_path(PACK), O_CREAT | O_WRONLY, 0644);
+    if (fd < 0)
+        die("can't create %s: %s", PACK, strerror(errno));
+    real_close(fd);
+    shared_map_init(&inverse_index, real_open(waitless_path(inverse_index.name), O_CREAT | O_WRONLY, 0644));
+}
+
+// TODO: thread safety
+static void initialize()
+{
+    static int initialized = 0;
+    if (initialized)
+        return;
+    initialized = 1;
+
+    shared_map_open(&inverse_index, waitless_path(inverse_index.name));
+}
+
+static int append_fd()
+{
+    struct stat st;
+    if (pack_fd >= 0 && real_fstat(pack_fd, &st) == 0
+        && st.st_dev == pack_dev && st.st_ino == pack_ino)
+        return pack_fd;
+
+    // If pack_fd was replaced it now belongs to someone else, so leave it be
+    const char *path = waitless_path(PACK);
+    int fd = real_open(path, O_WRONLY | O_APPEND, 0);
+    if (fd < 0)
+        die("can't open %s: %s", path, strerror(errno));
+    pack_fd = real_fcntl(fd, F_DUPFD, MAX_FDS);
+    if (pack_fd < 0)
+        die("can't dup %s: %s", path, strerror(errno));
+    real_close(fd);
+    if (real_fcntl(pack_fd, F_SETFD, FD_CLOEXEC) < 0 || real_fstat(pack_fd, &st) < 0)
+        die("can't set up %s: %s", path, strerror(errno));
+    pack_dev = st.st_dev;
+    pack_ino = st.st_ino;
+    return pack_fd;
+}
+
+static void close_append_fd()
+{
+    if (pack_fd >= 0)
+        real_close(pack_fd);
+    pack_fd = -1;
+}
+
+void inverse_map_forked()
+{
+    // Parent and child share a file offset, so an lseek after appending could
+    // see the other's record
+    close_append_fd();
+}
+
+// Make sure the first end bytes of the pack are mapped
+static void map_pack(size_t end)
+{
+    if (end <= pack_size)
+        return;
+
+    const char *path = waitless_path(PACK);
+    int fd = real_open(path, O_RDONLY, 0);
+    if (fd < 0)
+        die("can't open %s: %s", path, strerror(errno));
+    struct stat st;
+    if (real_fstat(fd, &st) < 0)
+        die("fstat failed: %s", strerror(errno));
+    if (st.st_size < end)
+        die("%s is truncated: %ld < %ld", path, (long)st.st_size, (long)end);
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        die("can't mmap %s of size %ld: %s", path, (long)st.st_size, strerror(errno));
+    real_close(fd);
+
+    if (pack_addr)
+        munmap((void*)pack_addr, pack_size);
+    pack_addr = addr;
+    pack_size = st.st_size;
+}
 
 void remember_hash_memory(struct hash *hash, const void *p, size_t n)
 {
     hash_memory(hash, p, n);
+    initialize();
 
-    const char *waitless_dir = getenv(WAITLESS_DIR);
-    if (!waitless_dir)
-        die("WAITLESS_DIR not set");
-    int dn = strlen(waitless_dir), in = strlen(INVERSE);
-    int total = dn + in + 3 + SHOW_HASH_SIZE;
-    if (total > PATH_MAX)
-        die("WAITLESS_DIR is too long: %d > %d", dn, PATH_MAX - total + dn);
-
-    // path = "waitless_dir/inverse/hash[0:2]/hash"
-    char path[total];
-    memcpy(path, waitless_dir, dn);
-    memcpy(path+dn, INVERSE, in);
-    show_hash(path+dn+in+3, SHOW_HASH_SIZE, hash);
-    memcpy(path+dn+in, path+dn+in+3, 2);
-    path[dn+in+2] = '/';
-
-retry:;
-
-    // Try to open path for exclusive create
-    int fd = real_open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
-    if (fd < 0) {
-        // Failed: either file exists (great!) or we need to make directories
-        int errno_ = errno;
-        if (errno_ == EEXIST) {
-            // If the file exists, we assume it already has the desired contents
-            // (go cryptographic hashing).
-            return;
-        }
-        else if (errno_ == ENOENT) {
-            // Create the necessary directory components
-            path[dn+in-1] = 0;
-            if (mkdir(path, 0755) < 0 && errno != EEXIST)
-                die("mkdir(\"%s\") failed: %s", path, strerror(errno));
-            path[dn+in-1] = '/';
-            path[dn+in+2] = 0;
-            if (mkdir(path, 0755) < 0 && errno != EEXIST)
-                die("mkdir(\"%s\") failed: %s", path, strerror(errno));
-            path[dn+in+2] = '/';
-
-            // Try to open again.  Note that it's possible to hit EEXIST on
-            // retry if another thread is trying to remember the same hash.
-            goto retry;
-        }
-        die("failed to create %s: %s", path, strerror(errno_));
-    }
+    // If the hash is already indexed, we assume the pack already has the
+    // desired contents (go cryptographic hashing).
+    struct inverse_entry entry;
+    if (shared_map_read(&inverse_index, hash, &entry))
+        return;
 
-    if (write(fd, p, n) != n)
+    // Append the record with a single write so that concurrent appends never
+    // interleave.  If two processes race to remember the same hash, the pack
+    // ends up with a harmless duplicate record.
+    char buffer[sizeof(struct inverse_record) + n];
+    struct inverse_record *record = (struct inverse_record*)buffer;
+    record->hash = *hash;
+    record->size = n;
+    memcpy(record->data, p, n);
+
+    // An O_APPEND write leaves our offset at the end of our own record
+    int fd = append_fd();
+    if (write(fd, buffer, sizeof(buffer)) != sizeof(buffer))
         die("remember_hash_memory: write failed: %s", strerror(errno));
-    if (real_close(fd) < 0)
-        die("remember_hash_memory: close failed: %s", strerror(errno));
+    off_t end = lseek(fd, 0, SEEK_CUR);
+    if (end < 0)
+        die("remember_hash_memory: lseek failed: %s", strerror(errno));
+
+    // Publish the record in the index
+    entry.offset = end - n;
+    entry.size = n;
+    shared_map_insert(&inverse_index, hash, &entry, 0);
 }
 
 void remember_hash_string(struct hash *hash, const char *s)
@@ -69,44 +173,206 @@ void remember_hash_string(struct hash *hash, const char *s)
     remember_hash_memory(hash, s, strlen(s));
 }
 
-// TODO: calling getcwd() every time might be slow.  This could be sped up by
-// caching the current directory and intercepting chdir calls.
+/*
+ * Each process caches its current directory, and memoizes the hashes of the
+ * paths it has remembered so that repeated lookups of the same path (gcc opens
+ * the same system headers over and over) cost a string compare.  Relative
+ * entries are tagged with the cwd generation, which forget_cwd bumps on every
+ * chdir, so they never outlive the directory they were resolved against.
+ * Absolute entries are tagged with generation 0.  Paths too long for an entry
+ * are simply not memoized.  TODO: thread safety
+ */
+
+struct path_memo
+{
+    struct hash hash;
+    uint32_t generation;
+    uint32_t length; // 0 if the entry is empty
+    char path[104];
+};
+
+#define PATH_MEMO_SIZE 1024 // must be a power of two
+
+static struct path_memo path_memo[PATH_MEMO_SIZE];
+static char cwd[PATH_MAX];
+static uint32_t cwd_generation = 1;
+static int cwd_known;
+
+void forget_cwd()
+{
+    cwd_known = 0;
+    cwd_generation++;
+}
+
+static const char *current_dir()
+{
+    if (!cwd_known) {
+        if (!real_getcwd(cwd, PATH_MAX))
+            die("remember_hash_path: getcwd failed: %s", strerror(errno));
+        cwd_known = 1;
+    }
+    return cwd;
+}
+
 void remember_hash_path(struct hash *hash, const char *path)
 {
-    char cwd[PATH_MAX];
-    if (!real_getcwd(cwd, PATH_MAX))
-        die("remember_hash_path: getcwd failed: %s", strerror(errno));
-    remember_hash_string(hash, path_join(cwd, path));
+    // FNV-1a is plenty for choosing a slot, since entries store the full path
+    uint32_t generation = path[0] == '/' ? 0 : cwd_generation;
+    uint32_t h = 2166136261u ^ generation;
+    size_t n;
+    for (n = 0; path[n]; n++)
+        h = (h ^ (uint8_t)path[n]) * 16777619u;
+
+    struct path_memo *memo = path_memo + (h & (PATH_MEMO_SIZE - 1));
+    if (memo->length == n + 1 && memo->generation == generation && !memcmp(memo->path, path, n)) {
+        *hash = memo->hash;
+        return;
+    }
+
+    remember_hash_string(hash, generation ? path_join(current_dir(), path) : path);
+    if (n < sizeof(memo->path)) {
+        memo->hash = *hash;
+        memo->generation = generation;
+        memo->length = n + 1;
+        memcpy(memo->path, path, n);
+    }
 }
 
 int inverse_hash_memory(const struct hash *hash, void *p, size_t n)
 {
-    const char *waitless_dir = getenv(WAITLESS_DIR);
-    if (!waitless_dir)
-        die("WAITLESS_DIR not set");
-    int dn = strlen(waitless_dir), in = strlen(INVERSE);
-    int total = dn + in + 3 + SHOW_HASH_SIZE;
-    if (total > PATH_MAX)
-        die("WAITLESS_DIR is too long: %d > %d", dn, PATH_MAX - total + dn);
-
-    // path = "waitless_dir/inverse/hash[0:2]/hash"
-    char path[total];
-    memcpy(path, waitless_dir, dn);
-    memcpy(path+dn, INVERSE, in);
-    show_hash(path+dn+in+3, SHOW_HASH_SIZE, hash);
-    memcpy(path+dn+in, path+dn+in+3, 2);
-    path[dn+in+2] = '/';
-
-    // Read path
-    // TODO: do enough file locking to prevent reading a partially written file
-    int fd = real_open(path, O_RDONLY, 0);
-    if (fd < 0)
-        die("inverse_hash_memory: failed to open %s: %s", path, strerror(errno));
-    size_t r = read(fd, p, n);
-    if (r < 0)
-        die("inverse_hash_memory: read failed: %s", strerror(errno));
-    real_close(fd);
-    return r;
+    initialize();
+
+    struct inverse_entry entry;
+    if (!shared_map_read(&inverse_index, hash, &entry)) {
+        char buffer[SHOW_HASH_SIZE];
+        show_hash(buffer, SHOW_HASH_SIZE, hash);
+        die("inverse_hash_memory: unknown hash %s", buffer);
+    }
+
+    map_pack(entry.offset + entry.size);
+    n = min(n, entry.size);
+    memcpy(p, pack_addr + entry.offset, n);
+    return n;
+}
+
+uint64_t inverse_map_bytes(const struct hash *hash)
+{
+    initialize();
+
+    struct inverse_entry entry;
+    if (!shared_map_read(&inverse_index, hash, &entry))
+        return 0;
+    return sizeof(struct inverse_record) + entry.size + shared_map_entry_bytes(&inverse_index);
+}
+
+void inverse_hash_many(int n, const struct hash hashes[], char *buffers, size_t size, int sizes[])
+{
+    initialize();
+
+    // Look up index entries in chunks to bound stack usage
+    enum { CHUNK = 64 };
+    int i, j;
+    for (i = 0; i < n; i += CHUNK) {
+        int m = min(n - i, CHUNK);
+        struct inverse_entry entries[CHUNK];
+        char found[CHUNK];
+        shared_map_read_many(&inverse_index, m, hashes + i, entries, found);
+
+        uint64_t end = 0;
+        for (j = 0; j < m; j++)
+            if (found[j])
+                end = max(end, entries[j].offset + entries[j].size);
+        map_pack(end);
+
+        for (j = 0; j < m; j++) {
+            char *s = buffers + (i + j) * size;
+            if (found[j]) {
+                int k = min(size - 1, (size_t)entries[j].size);
+                memcpy(s, pack_addr + entries[j].offset, k);
+                s[k] = 0;
+                sizes[i + j] = k;
+            }
+            else {
+                s[0] = 0;
+                sizes[i + j] = -1;
+            }
+        }
+    }
+}
+
+// State for inverse_map_compact
+static int (*compact_keep)(const struct hash *hash);
+static struct shared_map new_index = { "inverse.index", sizeof(struct inverse_entry), 1<<15, 1 };
+static int new_pack_fd;
+static uint64_t new_pack_size;
+static int compact_kept;
+
+static int compact_helper(const struct hash *hash, void *value)
+{
+    const struct inverse_entry *entry = value;
+    if (!compact_keep(hash))
+        return 0;
+
+    struct inverse_record record;
+    record.hash = *hash;
+    record.size = entry->size;
+    map_pack(entry->offset + entry->size);
+    if (write(new_pack_fd, &record, sizeof(record)) != sizeof(record)
+        || write(new_pack_fd, pack_addr + entry->offset, entry->size) != entry->size)
+        die("inverse_map_compact: write failed: %s", strerror(errno));
+
+    struct inverse_entry new_entry;
+    new_entry.offset = new_pack_size + sizeof(record);
+    new_entry.size = entry->size;
+    new_pack_size = new_entry.offset + entry->size;
+    shared_map_insert(&new_index, hash, &new_entry, 0);
+    compact_kept++;
+    return 0;
+}
+
+int inverse_map_compact(int (*keep)(const struct hash *hash))
+{
+    initialize();
+
+    // Copy the kept records into a new pack and index alongside the old ones
+    char pack_new[PATH_MAX], index_new[PATH_MAX];
+    strlcpy(pack_new, waitless_path("inverse.pack.new"), sizeof(pack_new));
+    strlcpy(index_new, waitless_path("inverse.index.new"), sizeof(index_new));
+    unlink(pack_new);
+    unlink(index_new);
+    new_pack_fd = real_open(pack_new, O_CREAT | O_WRONLY, 0644);
+    if (new_pack_fd < 0)
+        die("can't create %s: %s", pack_new, strerror(errno));
+    shared_map_init(&new_index, real_open(index_new, O_CREAT | O_WRONLY, 0644));
+    shared_map_open(&new_index, index_new);
+
+    compact_keep = keep;
+    new_pack_size = 0;
+    compact_kept = 0;
+    shared_map_lock(&inverse_index);
+    shared_map_iter(&inverse_index, compact_helper);
+    shared_map_unlock(&inverse_index);
+    if (real_close(new_pack_fd) < 0)
+        die("inverse_map_compact: close failed: %s", strerror(errno));
+
+    // Swap them into place.  A crash between the two renames would leave the
+    // index and pack inconsistent, which only waitless -c can repair.
+    if (real_rename(pack_new, waitless_path(PACK)) < 0
+        || real_rename(index_new, waitless_path(inverse_index.name)) < 0)
+        die("inverse_map_compact: rename failed: %s", strerror(errno));
+
+    // Forget our mappings of and descriptor for the old files, and memoized
+    // paths that may no longer be in the map
+    memset(path_memo, 0, sizeof(path_memo));
+    close_append_fd();
+    if (pack_addr)
+        munmap((void*)pack_addr, pack_size);
+    pack_addr = 0;
+    pack_size = 0;
+    munmap(new_index.addr, new_index.size);
+    munmap(inverse_index.addr, inverse_index.size);
+    shared_map_open(&inverse_index, waitless_path(inverse_index.name));
+    return compact_kept;
 }
 
 int inverse_hash_string(const struct hash *hash, char *s, size_t n)
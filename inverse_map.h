@@ -7,13 +7,13 @@
 
 /*
  * The inverse map stores the preimages of hash values, similar to the objects
- * directory under .git.  For now it is only used to store file paths, but in
- * future it could be extended to store cached versions of files.
- *
- * Note: The current implementation is simple but slow.
+ * directory under .git.  It stores file paths and other small records such as
+ * exec arguments; cached versions of files live in the content store (see
+ * content_store.h).  See inverse_map.c for the on-disk layout.
  */
 
-#include "hash.h"
+// Create the inverse map on disk if it does not already exist.
+extern void inverse_map_init();
 
 // Hash a block of memory and remember the contents
 extern void remember_hash_memory(struct hash *hash, const void *p, size_t n);
@@ -21,15 +21,36 @@ extern void remember_hash_memory(struct hash *hash, const void *p, size_t n);
 // Hash a string and remember the contents
 extern void remember_hash_string(struct hash *hash, const char *s);
 
-// Hash and remember a path (converting from relative to absolute if necessary)
+// Hash and remember a path (converting from relative to absolute if necessary).
+// Results are memoized per process, so repeated calls are cheap.
 extern void remember_hash_path(struct hash *hash, const char *path);
 
+// Note that the current directory has changed.  The chdir and fchdir stubs
+// must call this so that relative paths resolve against the new directory.
+extern void forget_cwd();
+
+// Note that we are the child of a fork.  action_fork must call this so that
+// parent and child don't append through the same descriptor.
+extern void inverse_map_forked();
+
 // Grab up to n bytes of a hash preimage.  Returns the amount grabbed.
-// This function is ideal only for logging purposes since it provides no
-// efficient way to get the rest of the preimage.
 extern int inverse_hash_memory(const struct hash *hash, void *p, size_t n);
 
 // Same as inverse_hash_memory, but adds a trailing null.
 extern int inverse_hash_string(const struct hash *hash, char *s, size_t n);
 
+// Grab up to size-1 bytes of n preimages at once, with a trailing null.
+// Preimage i goes in buffers + i*size and its length in sizes[i], or -1 if
+// hash i is unknown.  Much faster than separate calls for large n.
+extern void inverse_hash_many(int n, const struct hash hashes[], char *buffers, size_t size, int sizes[]);
+
+// Bytes the inverse map spends on the preimage of hash: its pack record plus
+// its share of the index.  Zero if hash is unknown.
+extern uint64_t inverse_map_bytes(const struct hash *hash);
+
+// Rewrite the inverse map keeping only the preimages of hashes for which keep
+// returns true.  Returns the number kept.  Must not run concurrently with other
+// waitless processes.
+extern int inverse_map_compact(int (*keep)(const struct hash *hash));
+
 #endif
@@ -0,0 +1,154 @@
+// Parallel priming of the stat cache
+
+#include "prime.h"
+#include "hash_parallel.h"
+#include "stat_cache.h"
+#include "inverse_map.h"
+#include "real_call.h"
+#include "env.h"
+#include "util.h"
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+
+/*
+ * prime is linked only into the waitless binary, so it is free to use threads.
+ * The shared maps are not thread safe, so only the main thread touches them:
+ * it walks the tree, collects files with stale stat cache entries into a
+ * batch, lets the worker threads hash the batch, and then records the results.
+ */
+
+#define BATCH 1024
+
+// Files at least this large are hashed one at a time using all threads
+#define BIG_FILE (64 << 20)
+
+struct job
+{
+    char path[PATH_MAX];
+    struct hash path_hash;
+    struct stat st;   // stat information at the time of hashing
+    struct hash hash; // contents hash
+    int big;          // hash using all threads after the rest of the batch
+    int ok;           // did the file hash cleanly?
+};
+
+static struct job jobs[BATCH];
+static int job_count, next_job;
+static int hashed;
+static uint64_t hashed_bytes;
+
+static void hash_job(struct job *job, int threads)
+{
+    job->ok = 0;
+    int fd = real_open(job->path, O_RDONLY | O_NOFOLLOW, 0);
+    if (fd < 0)
+        return;
+    struct stat after;
+    if (real_fstat(fd, &job->st) == 0 && S_ISREG(job->st.st_mode)) {
+        hash_fd_parallel(&job->hash, fd, threads);
+        // Files modified during hashing are left for the build to hash
+        job->ok = real_fstat(fd, &after) == 0
+            && after.st_mtimespec.tv_sec == job->st.st_mtimespec.tv_sec
+            && after.st_mtimespec.tv_nsec == job->st.st_mtimespec.tv_nsec
+            && after.st_size == job->st.st_size;
+    }
+    real_close(fd);
+}
+
+static void *worker(void *arg)
+{
+    for (;;) {
+        int i = __sync_fetch_and_add(&next_job, 1);
+        if (i >= job_count)
+            return 0;
+        if (!jobs[i].big)
+            hash_job(jobs + i, 1);
+    }
+}
+
+// Hash the current batch in parallel and record the results
+static void flush(int threads)
+{
+    pthread_t ids[threads];
+    int i;
+    next_job = 0;
+    for (i = 0; i < threads; i++)
+        if (pthread_create(ids + i, 0, worker, 0))
+            die("prime: pthread_create failed");
+    for (i = 0; i < threads; i++)
+        pthread_join(ids[i], 0);
+    for (i = 0; i < job_count; i++)
+        if (jobs[i].big)
+            hash_job(jobs + i, threads);
+
+    for (i = 0; i < job_count; i++) {
+        struct job *job = jobs + i;
+        if (job->ok) {
+            stat_cache_record_stat(&job->hash, &job->st, &job->path_hash);
+            hashed++;
+            hashed_bytes += job->st.st_size;
+        }
+    }
+    job_count = 0;
+}
+
+static void walk(char path[PATH_MAX], int n, int threads)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fdprintf(STDERR_FILENO, "prime: skipping %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        int m = n + 1 + strlen(e->d_name);
+        if (m >= PATH_MAX)
+            continue;
+        path[n] = '/';
+        strcpy(path + n + 1, e->d_name);
+
+        struct stat st;
+        if (real_lstat(path, &st) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            // Don't prime our own state
+            if (strcmp(path, waitless_env->dir))
+                walk(path, m, threads);
+        }
+        else if (S_ISREG(st.st_mode)) {
+            struct job *job = jobs + job_count;
+            remember_hash_string(&job->path_hash, path);
+            if (stat_cache_fresh(&job->path_hash, &st))
+                continue;
+            strcpy(job->path, path);
+            job->big = st.st_size >= BIG_FILE;
+            if (++job_count == BATCH)
+                flush(threads);
+        }
+    }
+    path[n] = 0;
+    closedir(dir);
+}
+
+void prime(const char *dir, int threads)
+{
+    char cwd[PATH_MAX], path[PATH_MAX];
+    if (!real_getcwd(cwd, sizeof(cwd)))
+        die("prime: getcwd failed: %s", strerror(errno));
+    strlcpy(path, path_join(cwd, dir), sizeof(path));
+    int n = strlen(path);
+    while (n > 1 && path[n-1] == '/')
+        path[--n] = 0;
+
+    job_count = hashed = 0;
+    hashed_bytes = 0;
+    walk(path, n, threads);
+    flush(threads);
+
+    fdprintf(STDOUT_FILENO, "prime: hashed %d files (%d MB) using %d threads\n",
+        hashed, (int)(hashed_bytes >> 20), threads);
+}
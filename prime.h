@@ -0,0 +1,15 @@
+// Parallel priming of the stat cache
+
+#ifndef __prime_h__
+#define __prime_h__
+
+/*
+ * The first build after a fresh checkout or waitless -c hashes every input
+ * serially as processes happen to open them.  prime walks the tree under dir
+ * ahead of time and hashes every regular file using threads threads, so that
+ * later lookups hit the stat cache.  Files whose stat cache entries are
+ * already up to date are skipped.
+ */
+extern void prime(const char *dir, int threads);
+
+#endif
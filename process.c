@@ -6,18 +6,46 @@
 #include "util.h"
 #include <errno.h>
 
-// TODO: make this dynamic
-#define MAX_PIDS 1024
+/*
+ * The process map is a header, an open addressed hash table from pid to
+ * entry, and a growable array of entries.  Every process maps the file at its
+ * maximum size, so growing it is just an ftruncate: entries never move, and
+ * other processes see new ones through their existing mappings.  Only pages
+ * that are touched cost memory or disk.
+ *
+ * Entries are recycled when a traced parent reaps the process (see the waitpid
+ * stub), or when a new process finds a stale entry under its own pid because
+ * the last owner was reaped by someone else.  The pid may already belong to
+ * such a new process by the time the parent's waitpid stub gets around to
+ * recycling, so each entry records its parent and the stub recycles only its
+ * own children's entries.  Linked processes refer to their
+ * master by entry number, since its pid may be reused once it is reaped: a
+ * reaped master leaves the index but keeps its entry until they are all
+ * reaped.
+ */
+
+#define MAX_INDEX (1 << 20)          // maximum size of the pid index
+#define MAP_RESERVE ((size_t)1 << 30) // maximum size of the process map
+#define INITIAL_ENTRIES 64
+#define INITIAL_INDEX 256
+#define DELETED ((uint32_t)-1)
 
 struct process_map
 {
-    // Lists the pid of the process at each map index
-    pid_t pids[MAX_PIDS];
     int killall; // if 1, no new entries can be added
-    spinlock_t pids_lock;
+    spinlock_t lock; // protects everything below (but not the entries)
+
+    uint32_t capacity;   // number of entries the file has room for
+    uint32_t allocated;  // number of entries ever handed out
+    uint32_t free;       // first recycled entry plus one, or zero
+    uint32_t index_size; // part of index in use, a power of two
+    uint32_t index_used; // nonempty slots of index, including DELETED ones
+
+    // Entry number plus one for each pid, zero if empty, or DELETED
+    uint32_t index[MAX_INDEX];
 
     // Per-process info
-    struct process processes[MAX_PIDS];
+    struct process processes[];
 };
 
 static spinlock_t map_lock;
@@ -25,22 +53,29 @@ static struct process_map *map;
 static struct process *self_info;
 static struct process *master_info;
 
-void make_fresh_process_map()
+static size_t map_size(uint32_t capacity)
 {
-    const char *waitless_dir = getenv(WAITLESS_DIR);
-    if (!waitless_dir)
-        die("WAITLESS_DIR not set");
+    return sizeof(struct process_map) + (size_t)capacity * sizeof(struct process);
+}
 
+void make_fresh_process_map()
+{
     char process_path[PATH_MAX];
-    strcpy(process_path, path_join(waitless_dir, "process.XXXXXXX")); // TODO: one unnecessary copy
+    strcpy(process_path, waitless_path("process.XXXXXXX"));
     int fd = mkstemp(process_path);
     if (fd < 0)
         die("mkstemp failed: %s", strerror(errno));
-    if (ftruncate(fd, sizeof(struct process_map)) < 0)
+    if (ftruncate(fd, map_size(INITIAL_ENTRIES)) < 0)
         die("ftruncate failed: %s", strerror(errno));
+    struct process_map *fresh = mmap(NULL, sizeof(struct process_map), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fresh == MAP_FAILED)
+        die("can't mmap process map %s: %s", process_path, strerror(errno));
+    fresh->capacity = INITIAL_ENTRIES;
+    fresh->index_size = INITIAL_INDEX;
+    munmap(fresh, sizeof(struct process_map));
     if (real_close(fd) < 0)
         die("close failed: %s", strerror(errno));
-    setenv(WAITLESS_PROCESS, process_path, 1);
+    env_set(WAITLESS_PROCESS, process_path);
 }
 
 static void initialize()
@@ -49,17 +84,21 @@ static void initialize()
         return;
 
     spin_lock(&map_lock);
+    if (!map) {
+        const char *waitless_process = waitless_env->process;
+        if (!waitless_process)
+            die("WAITLESS_PROCESS is not set");
 
-    const char *waitless_process = getenv(WAITLESS_PROCESS);
-    if (!waitless_process)
-        die("WAITLESS_PROCESS is not set");
-
-    int fd = real_open(waitless_process, O_RDWR, 0);
-    if (fd < 0)
-        die("can't open process map %s: %s", waitless_process, strerror(errno));
-    map = mmap(NULL, sizeof(struct process_map), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (map == MAP_FAILED)
-        die("can't mmap process map %s: %s", waitless_process, strerror(errno));
+        int fd = real_open(waitless_process, O_RDWR, 0);
+        if (fd < 0)
+            die("can't open process map %s: %s", waitless_process, strerror(errno));
+        void *addr = mmap(NULL, MAP_RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+            die("can't mmap process map %s: %s", waitless_process, strerror(errno));
+        real_close(fd);
+        map = addr;
+    }
+    spin_unlock(&map_lock);
 }
 
 static void cleanup()
@@ -68,50 +107,167 @@ static void cleanup()
     waitall();
 }
 
+// The index slot holding pid, or the empty slot where it would go.  The map
+// lock must be held.
+static uint32_t *index_find(pid_t pid)
+{
+    uint32_t mask = map->index_size - 1, i;
+    for (i = (uint32_t)pid * 2654435761u & mask;; i = (i + 1) & mask) {
+        uint32_t e = map->index[i];
+        if (!e || (e != DELETED && map->processes[e-1].pid == pid))
+            return map->index + i;
+    }
+}
+
+static void index_insert(uint32_t e)
+{
+    uint32_t mask = map->index_size - 1, i;
+    for (i = (uint32_t)map->processes[e].pid * 2654435761u & mask;; i = (i + 1) & mask)
+        if (!map->index[i] || map->index[i] == DELETED)
+            break;
+    if (!map->index[i])
+        map->index_used++;
+    map->index[i] = e + 1;
+}
+
+static int indexed(uint32_t e)
+{
+    return map->processes[e].pid && !map->processes[e].reaped;
+}
+
+// Rebuild the index from the entries, doubling it if it's over a quarter
+// full of live pids
+static void index_rebuild()
+{
+    uint32_t e, live = 0;
+    for (e = 0; e < map->allocated; e++)
+        live += indexed(e);
+    uint32_t size = map->index_size;
+    while (4 * live >= size)
+        size *= 2;
+    if (size > MAX_INDEX)
+        die("too many processes");
+
+    memset(map->index, 0, size * sizeof(uint32_t));
+    map->index_size = size;
+    map->index_used = 0;
+    for (e = 0; e < map->allocated; e++)
+        if (indexed(e))
+            index_insert(e);
+}
+
+// Take an entry off the free list, or a new one from the end of the file
+static uint32_t allocate()
+{
+    if (map->free) {
+        uint32_t e = map->free - 1;
+        map->free = map->processes[e].next_free;
+        return e;
+    }
+    if (map->allocated == map->capacity) {
+        uint32_t capacity = 2 * map->capacity;
+        if (map_size(capacity) > MAP_RESERVE)
+            die("too many processes");
+        int fd = real_open(waitless_env->process, O_RDWR, 0);
+        if (fd < 0 || ftruncate(fd, map_size(capacity)) < 0)
+            die("can't grow process map: %s", strerror(errno));
+        real_close(fd);
+        map->capacity = capacity;
+    }
+    return map->allocated++;
+}
+
+// Put an entry that is no longer in the index on the free list
+static void release(uint32_t e)
+{
+    map->processes[e].pid = 0;
+    map->processes[e].next_free = map->free;
+    map->free = e + 1;
+}
+
+// Mark the entry at an index slot reaped.  Its pid may be reused from now on,
+// so it leaves the index, but it stays allocated while linked processes still
+// refer to it.  The map lock must be held.
+static void retire(uint32_t *slot)
+{
+    uint32_t e = *slot - 1;
+    struct process *process = map->processes + e;
+    *slot = DELETED;
+    process->reaped = 1;
+    if (process->master) {
+        struct process *master = map->processes + process->master - 1;
+        if (!__sync_sub_and_fetch(&master->links, 1) && master->reaped)
+            release(process->master - 1);
+    }
+    if (!process->links)
+        release(e);
+}
+
 struct process *new_process_info()
 {
     initialize();
     pid_t pid = getpid();
     at_die = cleanup;
 
-    spin_lock(&map->pids_lock);
+    spin_lock(&map->lock);
     if (map->killall) {
-        spin_unlock(&map->pids_lock);
+        spin_unlock(&map->lock);
         real_exit(1);
     }
-    int i;
-    for (i = 0; i < MAX_PIDS; i++) {
-        if (map->pids[i] == pid) {
-            spin_unlock(&map->pids_lock);
-            die("new_process_info: entry already exists");
-        }
-        if (!map->pids[i])
-            break;
-    }
-    if (i == MAX_PIDS) {
-        spin_unlock(&map->pids_lock);
-        die("too many processes");
-    }
-    map->pids[i] = pid;
-    spin_unlock(&map->pids_lock);
+    // An existing entry for our pid is stale: its process was reaped by
+    // someone else, so retire it as if we had seen that happen.
+    uint32_t *slot = index_find(pid);
+    if (*slot)
+        retire(slot);
+    uint32_t e = allocate();
+    struct process *process = map->processes + e;
+    memset(process, 0, offsetof(struct process, fds.map));
+    process->pid = pid;
+    process->parent = getppid();
+    if (2 * (map->index_used + 1) > map->index_size)
+        index_rebuild();
+    else
+        index_insert(e);
+    spin_lock(&process->lock);
+    spin_unlock(&map->lock);
 
-    spin_lock(&map->processes[i].lock);
-    self_info = map->processes + i;
-    self_info->pid = pid;
+    self_info = process;
     master_info = 0;
     return self_info;
 }
 
+uint32_t link_process_info(struct process *master)
+{
+    __sync_add_and_fetch(&master->links, 1);
+    return master - map->processes + 1;
+}
+
+void reap_process_info(pid_t pid)
+{
+    initialize();
+
+    spin_lock(&map->lock);
+    uint32_t *slot = index_find(pid);
+    if (*slot && map->processes[*slot - 1].parent == getpid())
+        retire(slot);
+    spin_unlock(&map->lock);
+}
+
 struct process *find_process_info(pid_t pid)
 {
     initialize();
 
-    // No need to lock since pids is append only
-    int i;
-    for (i = 0; i < MAX_PIDS; i++)
-        if (map->pids[i] == pid)
-            return map->processes + i;
-    die("process_info: no entry exists");
+    spin_lock(&map->lock);
+    uint32_t e = *index_find(pid);
+    spin_unlock(&map->lock);
+    if (!e)
+        die("process_info: no entry exists");
+    return map->processes + e - 1;
+}
+
+struct process *master_process_info(struct process *process)
+{
+    return process->master ? map->processes + process->master - 1 : process;
 }
 
 struct process *process_info()
@@ -138,10 +294,7 @@ struct process *lock_master_process()
 {
     if (!master_info) {
         struct process *process = lock_process();
-        if (!process->master)
-            master_info = process;
-        else
-            master_info = find_process_info(process->master);
+        master_info = master_process_info(process);
         unlock_process();
     }
     spin_lock(&master_info->lock);
@@ -158,17 +311,17 @@ void killall()
     initialize();
 
     // Set killall = 1 to prevent future entry creation
-    spin_lock(&map->pids_lock);
+    spin_lock(&map->lock);
     map->killall = 1;
-    spin_unlock(&map->pids_lock);
 
     // Kill all existing processes
-    int self = getpid(), i;
-    for (i = 0; i < MAX_PIDS; i++) {
-        int pid = map->pids[i];
-        if (!pid)
-            break;
-        if (pid != self) // Don't kill ourself
+    int self = getpid();
+    uint32_t e;
+    for (e = 0; e < map->allocated; e++) {
+        // Reaped masters are skipped since their pids may belong to others
+        int pid = map->processes[e].pid;
+        if (indexed(e) && pid != self) // Don't kill ourself
             kill(pid, SIGKILL); 
     }
+    spin_unlock(&map->lock);
 }
@@ -37,13 +37,21 @@ struct process
     int flags;
 
     // If processes are linked by a pipe, subgraph nodes from both processes
-    // are interleaved into the process info of the master.
-    pid_t master;
+    // are interleaved into the process info of the master.  This is the
+    // master's entry as returned by link_process_info, or zero if unlinked.
+    uint32_t master;
 
     // Meaningful only if master is zero
     struct parents parents;
 
-    // Information about open file descriptors
+    // Process map bookkeeping (see process.c)
+    pid_t parent; // the process expected to reap this one
+    int links; // number of processes linked to this one as their master
+    int reaped;
+    uint32_t next_free;
+
+    // Information about open file descriptors.  This must come last: only
+    // the fields before fds.map are cleared when an entry is created.
     struct fd_map fds;
 };
 
@@ -55,9 +63,20 @@ extern void make_fresh_process_map();
 // initialization.
 extern struct process *new_process_info();
 
+// Note that a process about to be forked will be linked to master, so that
+// master's entry outlives it.  Returns the value for the child's master field.
+extern uint32_t link_process_info(struct process *master);
+
+// Recycle the entry of a child we've just reaped.  Entries of masters are
+// recycled once they and all their linked processes have been reaped.
+extern void reap_process_info(pid_t pid);
+
 // Find an existing entry for any process, or die if none exists.
 extern struct process *find_process_info(pid_t pid) __attribute__ ((pure));
 
+// The entry of process's master, or process itself if it isn't linked.
+extern struct process *master_process_info(struct process *process);
+
 // Find an existing entry for the current process.
 extern struct process *process_info() __attribute__ ((pure));
 
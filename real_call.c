@@ -100,6 +100,16 @@ int real_chdir(const char *path)
     return SYSCALL(chdir, path);
 }
 
+int real_fchdir(int fd)
+{
+    return SYSCALL(fchdir, fd);
+}
+
+int real_rename(const char *old, const char *new)
+{
+    return SYSCALL(rename, old, new);
+}
+
 pid_t real_fork(void)
 {
     return SYSCALL(fork);
@@ -51,6 +51,12 @@ typedef struct FILE FILE;
 #define F_SETFD 2
 #define F_GETFL 3
 #define F_SETFL 4
+#define FD_CLOEXEC 1
+
+// See sys/file.h or man flock
+#define LOCK_SH 0x01
+#define LOCK_EX 0x02
+#define LOCK_NB 0x04
 
 // See sys/mman.h or man mmap
 #define PROT_NONE  0x00
@@ -58,6 +64,8 @@ typedef struct FILE FILE;
 #define PROT_WRITE 0x02
 #define PROT_EXEC  0x04
 #define MAP_SHARED 0x0001
+#define MAP_PRIVATE 0x0002
+#define MAP_ANON   0x1000
 #define MAP_FAILED ((void *)-1)
 
 // See unistd.h or man stdout
@@ -85,6 +93,8 @@ extern int real_stat(const char *path, struct stat *buf);
 extern int real_fstat(int fd, struct stat *buf);
 extern int real_access(const char *path, int amode);
 extern int real_chdir(const char *path);
+extern int real_fchdir(int fd);
+extern int real_rename(const char *old, const char *new);
 extern pid_t real_fork(void);
 extern pid_t real_vfork(void);
 extern int real_execve(const char *path, const char *const argv[], const char *const envp[]);
@@ -119,12 +129,19 @@ extern char *getenv(const char *name);
 extern int setenv(const char *name, const char *value, int overwrite);
 extern int unsetenv(const char *name);
 extern void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+extern int munmap(void *addr, size_t len);
 extern int mkdir(const char *path, mode_t mode);
 extern int mkstemp(char *template);
 extern int unlink(const char *path);
 extern int ftruncate(int fd, off_t length);
+extern int fchmod(int fd, mode_t mode);
 extern int getpid(void);
+extern int getppid(void);
 extern int kill(pid_t pid, int signal);
+extern int sched_yield(void);
+extern int flock(int fd, int operation);
+extern int nanosleep(const struct timespec *req, struct timespec *rem);
+extern time_t time(time_t *t);
 extern int fflush(FILE *stream);
 
 #endif
@@ -0,0 +1,315 @@
+// Replay of recorded process trees
+
+#include "replay.h"
+#include "subgraph.h"
+#include "snapshot.h"
+#include "shared_map.h"
+#include "stat_cache.h"
+#include "inverse_map.h"
+#include "content_store.h"
+#include "search_path.h"
+#include "real_call.h"
+#include "util.h"
+
+/*
+ * Replay happens in two phases.  Validation walks the recorded tree and
+ * collects the writes it performs without touching anything on disk; the only
+ * side effects are the read and stat bits of the snapshot, which a real run
+ * would set identically up to the point where validation fails.  If the walk
+ * succeeds, the collected writes are committed: outputs that have since been
+ * changed or removed are restored from the content store, and the snapshot is
+ * updated.
+ */
+
+// Maximum number of writes in a replayed process tree (increase as needed)
+#define MAX_REPLAY_WRITES 1024
+
+struct replay_write
+{
+    struct hash path_hash;
+    struct hash contents_hash;
+    int restore; // does the file need to be restored from the content store?
+};
+
+struct replay
+{
+    int n;
+    struct replay_write writes[MAX_REPLAY_WRITES];
+};
+
+// Replay is never reentrant, so one static copy suffices
+static struct replay replay;
+
+static const struct replay_write *find_write(const struct hash *path_hash)
+{
+    int i;
+    for (i = 0; i < replay.n; i++)
+        if (hash_equal(&replay.writes[i].path_hash, path_hash))
+            return replay.writes + i;
+    return 0;
+}
+
+// Compute the existence or contents hash that action_lstat or action_open_read
+// would have seen for path_hash.  Returns false if the real action would have
+// died.
+static int replay_input(struct hash *hash, const char *path, const struct hash *path_hash, int do_hash)
+{
+    // Files written earlier in the replayed tree have their replayed contents
+    const struct replay_write *write = find_write(path_hash);
+    if (write) {
+        if (do_hash)
+            *hash = write->contents_hash;
+        else
+            memset(hash, -1, sizeof(struct hash));
+        return 1;
+    }
+
+    struct snapshot_entry *entry = snapshot_update(hash, path, path_hash, do_hash);
+    int writing = entry->writing;
+    if (!writing) {
+        if (do_hash)
+            entry->read = 1;
+        else
+            entry->stat = 1;
+    }
+    shared_map_unlock(&snapshot);
+    return !writing;
+}
+
+static int replay_stat(struct hash *exists_hash, const struct hash *path_hash)
+{
+    char path[PATH_MAX];
+    inverse_hash_string(path_hash, path, sizeof(path));
+    return replay_input(exists_hash, path, path_hash, 0);
+}
+
+static int replay_read(struct hash *contents_hash, const struct hash *path_hash)
+{
+    char path[PATH_MAX];
+    inverse_hash_string(path_hash, path, sizeof(path));
+    return replay_input(contents_hash, path, path_hash, 1);
+}
+
+// Set if a candidate of a replayed PATH search was written earlier in the
+// replayed tree, or is being written, so a real run would have differed
+static int search_busy;
+
+static void replay_probed(const char *path, int exists)
+{
+    struct hash path_hash, exists_hash;
+    remember_hash_path(&path_hash, path);
+    if (find_write(&path_hash)) {
+        search_busy = 1;
+        return;
+    }
+
+    // As in search_probed, the search already knows whether it exists
+    memset(&exists_hash, exists ? -1 : 0, sizeof(exists_hash));
+    struct snapshot_entry *entry = snapshot_record(&exists_hash, path, &path_hash);
+    if (entry->writing)
+        search_busy = 1;
+    else
+        entry->stat = 1;
+    shared_map_unlock(&snapshot);
+}
+
+static int replay_write(const struct hash *data)
+{
+    // Write nodes store hash(path_hash, contents_hash)
+    struct hash hashes[2];
+    if (inverse_hash_memory(data, hashes, sizeof(hashes)) != sizeof(hashes))
+        die("replay: corrupt write node");
+    const struct hash *path_hash = hashes, *contents_hash = hashes+1;
+
+    // A real run would die if the file was already touched
+    if (find_write(path_hash))
+        return 0;
+    snapshot_init();
+    shared_map_lock(&snapshot);
+    struct snapshot_entry *entry;
+    int busy = shared_map_lookup(&snapshot, path_hash, (void**)&entry, 0)
+        && (entry->read || entry->stat || entry->written || entry->writing);
+    shared_map_unlock(&snapshot);
+    if (busy)
+        return 0;
+
+    // If the recorded output is no longer in place, we need a stored copy
+    char path[PATH_MAX];
+    inverse_hash_string(path_hash, path, sizeof(path));
+    struct hash hash;
+    stat_cache_update(&hash, path, path_hash, 1);
+    int restore = !hash_equal(&hash, contents_hash);
+    if (restore && !content_exists(contents_hash)) {
+        wlog("replay: %s has changed and is not in the content store", path);
+        return 0;
+    }
+
+    if (replay.n == MAX_REPLAY_WRITES) {
+        wlog("replay: exceeded MAX_REPLAY_WRITES = %d", MAX_REPLAY_WRITES);
+        return 0;
+    }
+    replay.writes[replay.n].path_hash = *path_hash;
+    replay.writes[replay.n].contents_hash = *contents_hash;
+    replay.writes[replay.n].restore = restore;
+    replay.n++;
+    return 1;
+}
+
+// Compute the program hash that action_execve would have added as a parent
+static int replay_program(struct hash *program_hash, const char *path, const char *cwd)
+{
+    struct hash path_hash;
+    remember_hash_string(&path_hash, path_join(cwd, path));
+    return replay_read(program_hash, &path_hash);
+}
+
+/*
+ * Follow the chain of process nodes starting with the given parents until
+ * it ends in an exit node, recursing into the children of unlinked forks.
+ * See action.c for how each action determines the parents of the next node.
+ * Returns false if the chain leaves the subgraph or an input would have made
+ * the real run die.
+ */
+static int replay_chain(struct hash parents[2], int n, int *status)
+{
+    for (;;) {
+        struct hash name, data;
+        enum action_type type;
+        subgraph_node_name(&name, parents, n);
+        if (!subgraph_lookup(&name, &type, &data))
+            return 0;
+        parents[0] = name;
+        n = 1;
+
+        switch (type) {
+            case SG_STAT:
+                if (!replay_stat(parents+1, &data))
+                    return 0;
+                n = 2;
+                break;
+            case SG_READ:
+                if (!replay_read(parents+1, &data))
+                    return 0;
+                n = 2;
+                break;
+            case SG_WRITE:
+                if (!replay_write(&data))
+                    return 0;
+                break;
+            case SG_FORK:
+                // Linked forks (data zero) interleave both processes into one
+                // chain.  Otherwise the child continues from (fork, 0) and the
+                // parent from (fork, 1).
+                if (!hash_is_null(&data)) {
+                    struct hash child[2];
+                    int child_status;
+                    child[0] = name;
+                    memset(child+1, 0, sizeof(struct hash));
+                    if (!replay_chain(child, 2, &child_status))
+                        return 0;
+                    memset(parents+1, -1, sizeof(struct hash));
+                    n = 2;
+                }
+                break;
+            case SG_EXEC: {
+                // Linked execs continue the same chain.  Unlinked execs start
+                // over with parents (exec data, program contents).
+                char buffer[EXEC_DATA_SIZE];
+                struct exec_info info;
+                subgraph_exec_info(&info, buffer, &data);
+                if (!info.linked) {
+                    parents[0] = data;
+                    if (!replay_program(parents+1, info.path, info.cwd))
+                        return 0;
+                    n = 2;
+                }
+                break;
+            }
+            case SG_SEARCH: {
+                // Searches are redone from scratch, which is cheap given the
+                // search memo, and their candidates are marked as statted
+                char buffer[PATH_MAX];
+                search_busy = 0;
+                const char *path = search_path_again(buffer, &data, replay_probed);
+                if (search_busy)
+                    return 0;
+                if (path)
+                    hash_string(parents+1, path);
+                else
+                    memset(parents+1, 0, sizeof(struct hash));
+                n = 2;
+                break;
+            }
+            case SG_EXIT:
+                // Processes linked to this chain record their exits into it
+                // as well, so the chain ends only if no node follows.
+                *status = data.data[0];
+                subgraph_node_name(&name, parents, 1);
+                if (!subgraph_lookup(&name, &type, &data))
+                    return 1;
+                break;
+            default:
+                return 0;
+        }
+    }
+}
+
+static int commit_writes()
+{
+    // Restore outputs before touching the snapshot, so that a failed restore
+    // leaves the snapshot ready for a real run.  Outputs restored before the
+    // failure are harmless, since the real run will produce them again.
+    int i;
+    for (i = 0; i < replay.n; i++) {
+        const struct replay_write *write = replay.writes + i;
+        if (write->restore) {
+            char path[PATH_MAX];
+            inverse_hash_string(&write->path_hash, path, sizeof(path));
+            if (!content_restore(&write->contents_hash, path, &write->path_hash)) {
+                wlog("replay: failed to restore %s", path);
+                return 0;
+            }
+        }
+    }
+
+    snapshot_init();
+    for (i = 0; i < replay.n; i++) {
+        const struct replay_write *write = replay.writes + i;
+        shared_map_lock(&snapshot);
+        struct snapshot_entry *entry;
+        shared_map_lookup(&snapshot, &write->path_hash, (void**)&entry, 1);
+        entry->hash = write->contents_hash;
+        entry->written = 1;
+        shared_map_unlock(&snapshot);
+    }
+    return 1;
+}
+
+int replay_process(const struct hash *data_hash, const struct hash *program_hash, int *status)
+{
+    struct hash parents[2];
+    parents[0] = *data_hash;
+    parents[1] = *program_hash;
+
+    replay.n = 0;
+    return replay_chain(parents, 2, status) && commit_writes();
+}
+
+int replay_exec(const char *path, const char *const argv[], const char *const envp[], int *status)
+{
+    // Compute the parents of the first node of the new process exactly as
+    // action_execve would
+    char cwd[PATH_MAX];
+    if (!real_getcwd(cwd, sizeof(cwd)))
+        return 0;
+    struct hash data_hash, program_hash;
+    subgraph_exec_data(&data_hash, path, argv, envp, 0);
+
+    replay.n = 0;
+    if (!replay_program(&program_hash, path, cwd) || !replay_process(&data_hash, &program_hash, status)) {
+        wlog("replay: miss for %s", path);
+        return 0;
+    }
+    wlog("replay: hit for %s (%d writes, exit %d)", path, replay.n, *status);
+    return 1;
+}
@@ -0,0 +1,41 @@
+// Replay of recorded process trees
+
+#ifndef __replay_h__
+#define __replay_h__
+
+#include "hash.h"
+
+/*
+ * The subgraph records every action of every process waitless has run, and
+ * since the name of each process node is the hash of its parents, the name of
+ * the next node a process will create is determined by its current inputs.
+ * Replay exploits this: starting from the first node of a process, we follow
+ * the recorded nodes, recomputing each read or stat from the current state of
+ * the filesystem, until every process in the tree reaches its exit node.  If
+ * this succeeds, running the process tree for real would recreate exactly the
+ * recorded chain, so we can skip it and produce its writes and exit status
+ * directly.
+ *
+ * TODO: Output written to stdout and stderr is not tracked, and therefore
+ * not replayed.
+ */
+
+/*
+ * Try to replay the process that would be started by execve(path, argv, envp)
+ * from the current directory.  If every process node it would generate is
+ * already in the subgraph and all their inputs are unchanged, the recorded
+ * writes are performed, the snapshot is updated, status is set to the
+ * recorded exit status, and replay_exec returns true.  Otherwise nothing but
+ * the read and stat bits of the snapshot is touched and replay_exec returns
+ * false.
+ */
+extern int replay_exec(const char *path, const char *const argv[], const char *const envp[], int *status);
+
+/*
+ * Same as replay_exec, but for a process whose exec node has already been
+ * created.  data_hash and program_hash are the exec data and program contents
+ * hashes that form the parents of its first node.
+ */
+extern int replay_process(const struct hash *data_hash, const struct hash *program_hash, int *status);
+
+#endif
@@ -1,60 +1,266 @@
 // Search PATH for executable files
 
 #include "search_path.h"
+#include "shared_map.h"
+#include "inverse_map.h"
 #include "real_call.h"
+#include "env.h"
 #include "util.h"
 #include <string.h>
 #include <errno.h>
 
-// We call stat directly instead of real_stat to trigger action logic
-extern int stat(const char *path, struct stat *buf) STAT_ALIAS(stat);
+/*
+ * make and sh search PATH for every command they run, and a search stats one
+ * candidate per PATH entry.  Each search is memoized as the index of the PATH
+ * entry where the file was found, along with a hash of the stat information
+ * that determined that answer: the inode and mtime of every directory
+ * searched, since adding or removing a file changes its directory's mtime,
+ * and the inode, mtime and mode of every candidate that existed.  Checking a
+ * memo entry costs one stat per directory and no failing lookups.
+ */
 
-const char *search_path(char buffer[PATH_MAX], const char *file, const char *PATH)
+#define MAX_SEARCH_DIRS 64 // searches through longer PATHs are not memoized
+#define SEARCH_RECORD_SIZE (4*PATH_MAX)
+
+struct search_entry
 {
-    // Skip the search if file contains a slash
-    if (strchr(file, '/'))
-        return file;
+    int32_t found;       // index of the PATH entry containing file, or -1
+    uint64_t candidates; // bit i is set if PATH entry i contains file
+    struct hash stats;   // hash of the probes below
+};
 
-    // Lookup PATH if necessary
-    if (!PATH) {
-        PATH = getenv("PATH");
-        if (!PATH)
-            die("search_path: PATH not set");
+// What one stat saw, or all zero if the path didn't exist
+struct probe
+{
+    uint64_t ino;
+    int64_t sec, nsec;
+    uint64_t mode;
+};
+
+static struct shared_map searches = { "search_path", sizeof(struct search_entry), 1<<12 };
+
+void search_path_init()
+{
+    shared_map_init(&searches, real_open(waitless_path(searches.name), O_CREAT | O_WRONLY, 0644));
+}
+
+// TODO: thread safety
+static void initialize()
+{
+    static int initialized = 0;
+    if (initialized)
+        return;
+    initialized = 1;
+
+    shared_map_open(&searches, waitless_path(searches.name));
+}
+
+static void set_probe(struct probe *p, const struct stat *st)
+{
+    p->ino = st->st_ino;
+    p->sec = st->st_mtimespec.tv_sec;
+    p->nsec = st->st_mtimespec.tv_nsec;
+    p->mode = st->st_mode;
+}
+
+static void probe(struct probe *p, const char *path)
+{
+    struct stat st;
+    memset(p, 0, sizeof(*p));
+    if (real_stat(path, &st) == 0)
+        set_probe(p, &st);
+}
+
+// Fill buffer with the candidate for PATH entry dir of length nd, relative
+// to cwd if it isn't absolute.  Returns the length of the directory part.
+static int candidate(char buffer[PATH_MAX], const char *cwd, const char *dir, int nd, const char *file)
+{
+    int nc = dir[0] == '/' ? 0 : strlen(cwd), nf = strlen(file);
+    if (nc + nd + nf + 3 > PATH_MAX)
+        die("execvP: buffer space exceeded");
+    char *p = buffer;
+    if (nc) {
+        memcpy(p, cwd, nc);
+        p += nc;
+        *p++ = '/';
     }
+    memcpy(p, dir, nd);
+    p += nd;
+    *p = '/';
+    memcpy(p+1, file, nf+1);
+    return p - buffer;
+}
 
-    // TODO: The following code treats empty entries in PATH as if they weren't
-    // there.  That's wrong if empty entries are supposed to mean ".".
+// Iterate over the nonempty entries of PATH, with i counting all entries.
+// TODO: This treats empty entries in PATH as if they weren't there.  That's
+// wrong if empty entries are supposed to mean ".".
+#define FOR_EACH_DIR(PATH, i, dir, nd) \
+    for (dir = PATH, i = 0; *dir; dir += nd + (dir[nd] == ':'), i++) \
+        if (!(nd = strcspn(dir, ":"))) \
+            continue; \
+        else
 
-    // Check each component of PATH in order
-    size_t nf = strlen(file);
-    while (*PATH) {
-        const char *p = strchr(PATH, ':');
-        int np = p ? p - PATH : strlen(PATH);
-        if (np + 2 + nf > PATH_MAX)
-            die("execvP: buffer space exceeded");
-        memcpy(buffer, PATH, np);
-        buffer[np] = '/';
-        memcpy(buffer+np+1, file, nf+1);
+// Check memo against the filesystem.  If it still holds, return the path it
+// found in buffer.
+static int check(const struct search_entry *memo, char buffer[PATH_MAX], const char *file, const char *cwd, const char *PATH)
+{
+    struct probe probes[2*MAX_SEARCH_DIRS];
+    const char *dir;
+    int i, nd, n = 0;
+    FOR_EACH_DIR(PATH, i, dir, nd) {
+        int m = candidate(buffer, cwd, dir, nd, file);
+        buffer[m] = 0;
+        probe(probes + n++, buffer);
+        buffer[m] = '/';
+        if (memo->candidates & (uint64_t)1 << i)
+            probe(probes + n++, buffer);
+        if (i == memo->found)
+            break;
+    }
+    struct hash stats;
+    hash_memory(&stats, probes, n * sizeof(struct probe));
+    return hash_equal(&stats, &memo->stats);
+}
+
+// Call probed on each candidate a search would stat, up to and including the
+// one in PATH entry found, with its bit from candidates.  Entries past
+// MAX_SEARCH_DIRS have no bit, so only they are statted again.  This leaves
+// the found candidate in buffer.
+static void report(void (*probed)(const char *path, int exists), char buffer[PATH_MAX], const struct search_entry *entry, const char *file, const char *cwd, const char *PATH)
+{
+    const char *dir;
+    int i, nd;
+    FOR_EACH_DIR(PATH, i, dir, nd) {
+        candidate(buffer, cwd, dir, nd, file);
+        struct stat st;
+        if (i < MAX_SEARCH_DIRS)
+            probed(buffer, (entry->candidates >> i) & 1);
+        else
+            probed(buffer, i == entry->found || real_stat(buffer, &st) == 0);
+        if (i == entry->found)
+            break;
+    }
+}
+
+static const char *search(char buffer[PATH_MAX], const char *record, const struct hash *key, void (*probed)(const char *path, int exists))
+{
+    const char *file = record;
+    const char *cwd = file + strlen(file) + 1;
+    const char *PATH = cwd + strlen(cwd) + 1;
+
+    initialize();
+    struct search_entry memo;
+    if (shared_map_read(&searches, key, &memo) && check(&memo, buffer, file, cwd, PATH)) {
+        if (probed)
+            report(probed, buffer, &memo, file, cwd, PATH);
+        if (memo.found >= 0)
+            return buffer;
+        errno = ENOENT;
+        return 0;
+    }
+
+    // Check each component of PATH in order, statting each directory before
+    // its candidate so that a file created in between changes the mtime we
+    // record.  Directories modified in the last second or two might change
+    // again without their mtime changing, so searches involving them aren't
+    // memoized.
+    struct search_entry entry = { -1, 0 };
+    struct probe probes[2*MAX_SEARCH_DIRS];
+    int i, nd, n = 0, memoize = 1;
+    time_t now = time(0);
+    const char *dir;
+    FOR_EACH_DIR(PATH, i, dir, nd) {
+        int m = candidate(buffer, cwd, dir, nd, file);
+        if (i >= MAX_SEARCH_DIRS)
+            memoize = 0;
+        else {
+            buffer[m] = 0;
+            probe(probes + n, buffer);
+            buffer[m] = '/';
+            if (probes[n++].sec >= now - 1)
+                memoize = 0;
+        }
 
         // TODO: The real execve is more permissive (it'll keep searching on
         // a large class of execve errors).
         struct stat st;
-        if (stat(buffer, &st) < 0) {
+        if (real_stat(buffer, &st) < 0) {
             if (errno != ENOENT)
                 die("execvP: stat '%s' failed: %s", buffer, strerror(errno));
+            continue;
         }
-        else if (st.st_mode & S_IXUSR) {
-            // Found an executable file!
-            return buffer;
+        if (i < MAX_SEARCH_DIRS) {
+            entry.candidates |= (uint64_t)1 << i;
+            set_probe(probes + n++, &st);
         }
-
-        // Advance to the next entry
-        if (!p)
+        if (st.st_mode & S_IXUSR) {
+            // Found an executable file!
+            entry.found = i;
             break;
-        PATH += np+1;
+        }
     }
 
-    // Failed
+    if (memoize) {
+        hash_memory(&entry.stats, probes, n * sizeof(struct probe));
+        shared_map_lock(&searches);
+        struct search_entry *value;
+        shared_map_lookup(&searches, key, (void**)&value, 1);
+        *value = entry;
+        shared_map_unlock(&searches);
+    }
+    if (probed)
+        report(probed, buffer, &entry, file, cwd, PATH);
+    if (entry.found >= 0)
+        return buffer;
     errno = ENOENT;
     return 0;
 }
+
+const char *search_path(char buffer[PATH_MAX], const char *file, const char *PATH, struct hash *record_hash, void (*probed)(const char *path, int exists))
+{
+    // Skip the search if file contains a slash
+    if (strchr(file, '/'))
+        return file;
+
+    // Lookup PATH if necessary
+    if (!PATH) {
+        PATH = getenv("PATH");
+        if (!PATH)
+            die("search_path: PATH not set");
+    }
+
+    // Pack the search record, including the current directory only if some
+    // entry of PATH is relative
+    char cwd[PATH_MAX] = "";
+    const char *dir;
+    int i, nd;
+    FOR_EACH_DIR(PATH, i, dir, nd)
+        if (dir[0] != '/') {
+            if (!real_getcwd(cwd, PATH_MAX))
+                die("search_path: getcwd failed: %s", strerror(errno));
+            break;
+        }
+    char record[SEARCH_RECORD_SIZE];
+    int nf = strlen(file), nc = strlen(cwd), np = strlen(PATH);
+    if (nf + nc + np + 2 > sizeof(record))
+        die("search_path: PATH is too long");
+    memcpy(record, file, nf+1);
+    memcpy(record+nf+1, cwd, nc+1);
+    memcpy(record+nf+nc+2, PATH, np+1);
+
+    struct hash key;
+    if (record_hash) {
+        remember_hash_memory(record_hash, record, nf + nc + np + 2);
+        key = *record_hash;
+    }
+    else
+        hash_memory(&key, record, nf + nc + np + 2);
+    return search(buffer, record, &key, probed);
+}
+
+const char *search_path_again(char buffer[PATH_MAX], const struct hash *record_hash, void (*probed)(const char *path, int exists))
+{
+    char record[SEARCH_RECORD_SIZE];
+    inverse_hash_string(record_hash, record, sizeof(record));
+    return search(buffer, record, record_hash, probed);
+}
@@ -3,6 +3,7 @@
 #ifndef __search_path_h__
 #define __search_path_h__
 
+#include "hash.h"
 #include "arch.h"
 
 /*
@@ -14,9 +15,24 @@
  * search_path has slightly different error semantics than execvp, but it
  * should be close enough.
  *
- * search_path intentionally calls stat (instead of real_stat) in order to
- * trigger the appropriate action logic when called within the preload stub.
+ * The inputs to a search are packed into a search record "file\0cwd\0PATH",
+ * where cwd is empty unless PATH has relative entries.  Results are memoized
+ * in a shared map keyed by the hash of the record and validated against the
+ * stat information of the PATH directories (see search_path.c), and the
+ * search itself uses real_stat, so the caller is responsible for recording
+ * any dependencies (see action_search_path).  If record_hash is nonnull, the
+ * record is remembered in the inverse map and its hash stored there.  If
+ * probed is nonnull, it is called on each candidate path that an unmemoized
+ * search would stat, in order, whether or not the result was memoized, along
+ * with whether stat found it.  A memo hit already knows the answer, so
+ * reporting it costs no further system calls.
  */
-const char *search_path(char buffer[PATH_MAX], const char *file, const char *PATH);
+extern const char *search_path(char buffer[PATH_MAX], const char *file, const char *PATH, struct hash *record_hash, void (*probed)(const char *path, int exists));
+
+// Redo the search with the given record hash, e.g., during replay.
+extern const char *search_path_again(char buffer[PATH_MAX], const struct hash *record_hash, void (*probed)(const char *path, int exists));
+
+// Create the search memo on disk if it does not already exist.
+extern void search_path_init();
 
 #endif
@@ -5,7 +5,200 @@
 #include "real_call.h"
 #include <errno.h>
 
-void shared_map_init(const struct shared_map *map, int fd)
+/*
+ * Each shared map file starts with a header followed by count entries.
+ *
+ * The entries are divided into contiguous stripes of equal size, each with
+ * its own lock living in the header.  Probing wraps around within a stripe
+ * rather than the whole table, so every stripe is an independent little hash
+ * table and an operation on one key needs exactly one lock.  Operations that
+ * touch the whole table (iteration and growth) take every lock in increasing
+ * order.  Since nobody ever waits for a second lock while holding a single
+ * stripe, this can't deadlock.
+ *
+ * Each stripe also has a sequence count, which is odd while a writer holds
+ * the stripe.  shared_map_read uses it to read entries optimistically without
+ * taking any lock.
+ *
+ * A map grows by building a table twice the size in a new file and renaming
+ * it over the old one, which is then marked replaced so that every process
+ * still using it remaps.  The old file is left intact until the rename, so a
+ * grower killed midway loses nothing: the next process to steal its locks
+ * either finishes the job or finds the new file already in place.
+ *
+ * Maps whose values never change once inserted (map->immutable) skip the
+ * stripe locks entirely.  Inserters claim an empty entry by compare and swap
+ * on its control byte (see below), fill in the key and value, and then
+ * publish the entry, and readers simply ignore entries that aren't published
+ * yet.  Growth is the only thing such maps need to exclude, so the header has
+ * a generation count (odd during growth), and inserters in flight register
+ * their pids in writer slots in the stripe of their key.  An entry's claim
+ * names its inserter's writer slot, so if an inserter dies, whoever notices
+ * can clear its claims and free its slot, just as a dead process's stripe
+ * lock is stolen.
+ */
+#define SHARED_MAP_MAGIC 0x77616d37 // "wam7"
+
+// Maximum number of stripes per map
+#define MAX_STRIPES 64
+
+// Minimum number of entries per stripe
+#define MIN_STRIPE_SIZE 64
+
+#define CACHE_LINE 64
+
+// Number of lock free writers that can be in flight in one stripe, which is
+// as many as fit in the rest of the stripe's cache line
+#define WRITER_SLOTS 13
+
+// Each stripe gets a cache line to itself, so that processes working on
+// different stripes don't bounce each other's lock lines
+struct stripe
+{
+    uint32_t lock;   // pid of the process holding the stripe, or zero
+    uint32_t seq;    // odd while the stripe is being modified
+    uint32_t filled; // number of entries with nonnull keys in this stripe
+    uint32_t writers[WRITER_SLOTS]; // pids of lock free writers in flight, or zero
+};
+
+struct header
+{
+    uint32_t magic;
+    uint32_t entry_size;
+    uint32_t count;  // number of entries in the hash table (filled or unfilled)
+    uint32_t filled; // number of entries with nonnull keys
+    uint32_t generation; // odd while the map is growing
+    uint32_t hash; // HASH_BACKEND used for the keys (see hash.h)
+    uint32_t grower; // pid of the process growing the map, if any
+    uint32_t replaced; // a grown copy of the map has been renamed over this file
+    char padding[32]; // start the stripes on the next cache line
+    struct stripe stripes[MAX_STRIPES];
+};
+
+#define HEADER_SIZE sizeof(struct header)
+
+/*
+ * Entries are arranged in groups of GROUP_SIZE, each starting on a cache line
+ * with one control byte per entry.  A control byte is either empty, claimed
+ * (see below), or the high bit plus seven bits of the key that are not used
+ * for the index.  Probing compares a key's fingerprint against a whole group
+ * of control bytes at once and only looks at the full keys of the matches,
+ * so a typical lookup touches the control bytes and a single entry.  A key
+ * lives in its home group or in the first following group (within its
+ * stripe) that had space, and since entries are never removed, a probe can
+ * stop at the first group with an empty entry.
+ */
+#define GROUP_SIZE 16
+
+#define CTRL_EMPTY 0x00
+#define CTRL_CLAIMED 0x01 // plus a writer slot: that insert is filling in the entry
+#define CTRL_PUBLISHED 0x80
+
+// Grow once a stripe is more than 7/8 full.  Group probing holds up well at
+// high load, since each step checks GROUP_SIZE entries.
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+
+// Special values of map->stripe
+#define NO_STRIPE -1
+#define ALL_STRIPES -2
+
+struct entry {
+    struct hash key;
+    char value[0];
+};
+
+// Where a key lives or should go
+struct slot {
+    uint8_t *ctrl;
+    struct entry *entry;
+    int claimed; // did the probe pass any claimed entries?
+};
+
+static inline struct header *header(struct shared_map *map)
+{
+    return map->addr;
+}
+
+static size_t group_bytes(uint32_t entry_size)
+{
+    size_t bytes = GROUP_SIZE + GROUP_SIZE * entry_size;
+    return (bytes + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+}
+
+static size_t file_size(uint32_t count, uint32_t entry_size)
+{
+    return HEADER_SIZE + (size_t)(count / GROUP_SIZE) * group_bytes(entry_size);
+}
+
+static inline uint8_t *group(struct shared_map *map, uint32_t g)
+{
+    return map->addr + HEADER_SIZE + (size_t)map->group_bytes * g;
+}
+
+static inline struct entry *group_entry(struct shared_map *map, uint8_t *group, uint32_t i)
+{
+    return (struct entry*)(group + GROUP_SIZE + map->entry_size * i);
+}
+
+static inline uint32_t stripe_count(uint32_t count)
+{
+    return count >= MAX_STRIPES * MIN_STRIPE_SIZE ? MAX_STRIPES
+         : count >= MIN_STRIPE_SIZE ? count / MIN_STRIPE_SIZE : 1;
+}
+
+// The group where key would ideally go.  key is a cryptographic hash, so the
+// first few bytes are a good hash index, and the next few bytes make a good
+// fingerprint.  We use native little endian order for speed.
+// TODO: on big endian machines, we'll have to swap bytes here
+static inline uint32_t home_group(struct shared_map *map, const struct hash *key)
+{
+    return key->data[0] & map->group_mask;
+}
+
+static inline uint8_t fingerprint(const struct hash *key)
+{
+    return CTRL_PUBLISHED | (key->data[1] & 0x7f);
+}
+
+static inline uint32_t key_stripe(struct shared_map *map, const struct hash *key)
+{
+    return home_group(map, key) >> map->stripe_shift;
+}
+
+// Returns a mask with bit i set iff ctrl[i] == byte
+static inline uint32_t match_byte(const uint8_t *ctrl, uint8_t byte)
+{
+#ifdef __SSE2__
+    typedef char v16qi __attribute__((vector_size(16)));
+    char b = byte;
+    v16qi c = *(const volatile v16qi*)ctrl;
+    v16qi bs = { b, b, b, b, b, b, b, b, b, b, b, b, b, b, b, b };
+    return __builtin_ia32_pmovmskb128((v16qi)(c == bs));
+#else
+    uint32_t i, mask = 0;
+    for (i = 0; i < GROUP_SIZE; i++)
+        mask |= (((const volatile uint8_t*)ctrl)[i] == byte) << i;
+    return mask;
+#endif
+}
+
+// Returns a mask with bit i set iff ctrl[i] is published
+static inline uint32_t match_published(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+    typedef char v16qi __attribute__((vector_size(16)));
+    return __builtin_ia32_pmovmskb128(*(const volatile v16qi*)ctrl);
+#else
+    uint32_t i, mask = 0;
+    for (i = 0; i < GROUP_SIZE; i++)
+        mask |= (((const volatile uint8_t*)ctrl)[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+// Write an empty map with count entries to fd unless the file is nonempty
+static void init_file(const struct shared_map *map, int fd, uint32_t count)
 {
     if (fd < 0)
         die("could not create shared map '%s'", map->name);
@@ -14,35 +207,167 @@ void shared_map_init(const struct shared_map *map, int fd)
     if (real_fstat(fd, &st) < 0)
         die("fstat failed in shared_map_init: %s", strerror(errno));
     if (!st.st_size) {
-        size_t default_size = map->default_count * (sizeof(struct hash) + map->value_size);
-        if (ftruncate(fd, default_size) < 0)
+        struct header h;
+        memset(&h, 0, sizeof(h));
+        h.magic = SHARED_MAP_MAGIC;
+        h.entry_size = sizeof(struct entry) + map->value_size;
+        h.hash = HASH_BACKEND;
+        h.count = count;
+        if (ftruncate(fd, file_size(h.count, h.entry_size)) < 0)
             die("shared_map_init failed in ftruncate: %s", strerror(errno));
+        if (write(fd, &h, sizeof(h)) != sizeof(h))
+            die("shared_map_init failed to write header: %s", strerror(errno));
     }
     if (real_close(fd) < 0)
         die("shared_map_init close failed: %s", strerror(errno));
 }
 
-void shared_map_open(struct shared_map *map, const char *path)
+void shared_map_init(const struct shared_map *map, int fd)
 {
-    // Each entry is a (key,value) pair
-    map->entry_size = sizeof(struct hash) + map->value_size;
+    if (map->default_count < GROUP_SIZE || map->default_count & (map->default_count - 1))
+        die("shared map '%s' has default count %d, which is not a power of two >= %d", map->name, map->default_count, GROUP_SIZE);
+    init_file(map, fd, map->default_count);
+}
 
-    int fd = real_open(path, O_RDWR, 0);
+// Map the file at map->path into memory, replacing any existing mapping
+static void map_file(struct shared_map *map)
+{
+    int fd = real_open(map->path, O_RDWR, 0);
     if (fd < 0)
-        die("can't open shared map '%s'", path);
+        die("can't open shared map '%s'", map->path);
     struct stat st;
     if (real_fstat(fd, &st) < 0)
         die("fstat failed: %s", strerror(errno));
-    if (!st.st_size)
-        die("shared_map %s has zero size", path);
-    map->count = st.st_size / map->entry_size;
-    if (map->count * map->entry_size != st.st_size)
-        die("shared map '%s' is corrupt: %ld is not a multiple of %ld", path, st.st_size, map->entry_size);
-    map->addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (map->addr == MAP_FAILED)
-        die("can't mmap shared map %s of size %ld: %s", path, (long)st.st_size, strerror(errno));
+    if (st.st_size < HEADER_SIZE)
+        die("shared_map %s is too small (%ld bytes)", map->path, (long)st.st_size);
+    void *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        die("can't mmap shared map %s of size %ld: %s", map->path, (long)st.st_size, strerror(errno));
+    real_close(fd);
+
+    struct header *h = addr;
+    if (h->magic != SHARED_MAP_MAGIC || h->entry_size != map->entry_size)
+        die("shared map '%s' has an incompatible format (try waitless -c)", map->path);
+    if (h->hash != HASH_BACKEND)
+        die("shared map '%s' was written with a different hash function than %s (try waitless -c)",
+            map->path, hash_backend->name);
+    if (st.st_size < file_size(h->count, h->entry_size))
+        die("shared map '%s' is corrupt: %ld bytes is too small for %d entries", map->path, (long)st.st_size, h->count);
+
+    if (map->addr)
+        munmap(map->addr, map->size);
+    map->addr = addr;
+    map->size = st.st_size;
+    map->dev = st.st_dev;
+    map->ino = st.st_ino;
+    map->count = h->count;
+    map->group_mask = map->count / GROUP_SIZE - 1;
+    map->stripe_shift = __builtin_ctz(map->count / GROUP_SIZE / stripe_count(map->count));
+}
+
+void shared_map_open(struct shared_map *map, const char *path)
+{
+    // Each entry is a (key,value) pair
+    map->entry_size = sizeof(struct entry) + map->value_size;
+    map->group_bytes = group_bytes(map->entry_size);
+
+    if (strlcpy(map->path, path, sizeof(map->path)) >= sizeof(map->path))
+        die("shared map path '%s' is too long", path);
+    map->addr = 0;
+    map_file(map);
 
     map->lock_held = 0;
+    map->stripe = NO_STRIPE;
+}
+
+// If map->path no longer names the file we have mapped, its grower died
+// between renaming the new table into place and marking the old one
+// replaced.  Finish the job so that everyone using the old file remaps.
+static void check_replaced(struct shared_map *map)
+{
+    struct stat st;
+    if (real_stat(map->path, &st) == 0 && (st.st_ino != map->ino || st.st_dev != map->dev)) {
+        __sync_synchronize();
+        header(map)->replaced = 1;
+    }
+}
+
+// Spin until we hold the given stripe lock.  If the holder dies without
+// releasing the lock, we steal it.
+static void lock_stripe(struct shared_map *map, uint32_t s)
+{
+    struct stripe *stripe = header(map)->stripes + s;
+    volatile uint32_t *lock = &stripe->lock;
+    uint32_t pid = getpid();
+    int spins;
+    for (spins = 0;; spins++) {
+        uint32_t holder = *lock;
+        if (!holder) {
+            if (__sync_bool_compare_and_swap(lock, 0, pid))
+                break;
+        }
+        else if (spins >= 1000) {
+            // The holder might have been descheduled, so back off.  Check
+            // occasionally whether it is still alive.
+            sched_yield();
+            if (!(spins % 1000) && kill(holder, 0) < 0 && errno == ESRCH
+                && __sync_bool_compare_and_swap(lock, holder, pid)) {
+                wlog("shared map %s: stealing stripe %d from dead process %d", map->name, s, holder);
+                check_replaced(map);
+                break;
+            }
+        }
+    }
+
+    // A stolen stripe may already have an odd sequence count
+    if (!(stripe->seq & 1))
+        stripe->seq++;
+    __sync_synchronize();
+}
+
+static void unlock_stripe(struct shared_map *map, uint32_t s)
+{
+    struct stripe *stripe = header(map)->stripes + s;
+    __sync_synchronize();
+    stripe->seq++;
+    __sync_lock_release(&stripe->lock);
+}
+
+static void unlock_all(struct shared_map *map)
+{
+    uint32_t s;
+    for (s = 0; s < MAX_STRIPES; s++)
+        unlock_stripe(map, s);
+}
+
+// Take every stripe lock, catching up with any growth by other processes
+static void lock_all(struct shared_map *map)
+{
+    for (;;) {
+        uint32_t s;
+        for (s = 0; s < MAX_STRIPES; s++)
+            lock_stripe(map, s);
+        if (!header(map)->replaced)
+            return;
+        unlock_all(map);
+        map_file(map);
+    }
+}
+
+// Take the stripe lock for key, catching up with any growth by other
+// processes.  Returns the stripe.
+static uint32_t lock_key(struct shared_map *map, const struct hash *key)
+{
+    for (;;) {
+        uint32_t s = key_stripe(map, key);
+        lock_stripe(map, s);
+        // Growth takes every stripe, so the file can't be replaced while we
+        // hold one
+        if (!header(map)->replaced)
+            return s;
+        unlock_stripe(map, s);
+        map_file(map);
+    }
 }
 
 void shared_map_lock(struct shared_map *map)
@@ -57,12 +382,167 @@ void shared_map_unlock(struct shared_map *map)
     if (!map->lock_held)
         die("called shared_map_unlock with no lock held");
     map->lock_held = 0;
+
+    if (map->stripe == ALL_STRIPES)
+        unlock_all(map);
+    else if (map->stripe != NO_STRIPE)
+        unlock_stripe(map, map->stripe);
+    map->stripe = NO_STRIPE;
 }
 
-struct entry {
-    struct hash key;
-    char value[0];
-};
+// Find either key or the free entry where it should go within key's stripe.
+// Returns 1 if key was found.  If the stripe is full, which can happen only
+// with torn optimistic reads, slot->ctrl is set to null.  Entries which aren't
+// published yet are skipped.
+static int probe(struct shared_map *map, const struct hash *key, struct slot *slot)
+{
+    uint32_t groups = 1 << map->stripe_shift;
+    uint32_t home = home_group(map, key);
+    uint32_t base = home & ~(groups - 1);
+    uint8_t fp = fingerprint(key);
+    slot->claimed = 0;
+
+    uint32_t i;
+    for (i = 0; i < groups; i++) {
+        uint8_t *g = group(map, base | ((home + i) & (groups - 1)));
+        uint32_t matches = match_byte(g, fp);
+        while (matches) {
+            uint32_t j = __builtin_ctz(matches);
+            struct entry *e = group_entry(map, g, j);
+            __sync_synchronize(); // read the key after its control byte
+            if (hash_equal(&e->key, key)) {
+                slot->ctrl = g + j;
+                slot->entry = e;
+                return 1;
+            }
+            matches &= matches - 1;
+        }
+        uint32_t empty = match_byte(g, CTRL_EMPTY);
+        slot->claimed |= (empty | match_published(g)) != (1 << GROUP_SIZE) - 1;
+        if (empty) {
+            uint32_t j = __builtin_ctz(empty);
+            slot->ctrl = g + j;
+            slot->entry = group_entry(map, g, j);
+            return 0;
+        }
+    }
+    slot->ctrl = 0;
+    slot->entry = 0;
+    return 0;
+}
+
+static inline int stripe_full(struct shared_map *map, struct stripe *stripe)
+{
+    return MAX_LOAD_DEN * (uint64_t)(stripe->filled + 1) > MAX_LOAD_NUM * (uint64_t)map->count / stripe_count(map->count);
+}
+
+// If the lock free writer in slot k of stripe s has died, clear the entries it
+// claimed but never published and free its slot.  The slot is taken over
+// while clearing, so that a new writer can't claim anything under us.
+static void reclaim_writer(struct shared_map *map, uint32_t s, uint32_t k)
+{
+    struct stripe *stripe = header(map)->stripes + s;
+    uint32_t writer = stripe->writers[k];
+    if (!writer || !(kill(writer, 0) < 0 && errno == ESRCH)
+        || !__sync_bool_compare_and_swap(&stripe->writers[k], writer, getpid()))
+        return;
+    wlog("shared map %s: reclaiming writer slot %d of stripe %d from dead process %d", map->name, k, s, writer);
+
+    uint8_t claim = CTRL_CLAIMED + k;
+    uint32_t g, j;
+    for (g = s << map->stripe_shift; g < (s + 1) << map->stripe_shift; g++) {
+        uint8_t *ctrl = group(map, g);
+        uint32_t claimed = match_byte(ctrl, claim);
+        for (; claimed; claimed &= claimed - 1) {
+            j = __builtin_ctz(claimed);
+            __sync_bool_compare_and_swap(ctrl + j, claim, CTRL_EMPTY);
+        }
+    }
+    __sync_lock_release(&stripe->writers[k]);
+}
+
+static void reclaim_writers(struct shared_map *map, uint32_t s)
+{
+    uint32_t k;
+    for (k = 0; k < WRITER_SLOTS; k++)
+        reclaim_writer(map, s, k);
+}
+
+/*
+ * Double the size of the map by rehashing every entry into a new file and
+ * renaming it over the old one.  Other processes notice that the old file has
+ * been replaced and remap the next time they lock the map.  Does nothing if
+ * another process already grew the map past old_count.
+ */
+static void grow(struct shared_map *map, uint32_t old_count)
+{
+    lock_all(map);
+    if (map->count != old_count) {
+        unlock_all(map);
+        return;
+    }
+
+    uint32_t count = 2 * old_count;
+    wlog("growing shared map %s from %d to %d entries", map->name, old_count, count);
+
+    // Stop new lock free inserts and wait for the ones in flight.  If an
+    // earlier grower died midway, the generation is already odd.
+    struct header *h = header(map);
+    h->grower = getpid();
+    __sync_synchronize();
+    if (!(h->generation & 1))
+        h->generation++;
+    __sync_synchronize();
+    uint32_t s, k;
+    int spins;
+    for (s = 0; s < stripe_count(map->count); s++)
+        for (k = 0; k < WRITER_SLOTS; k++)
+            for (spins = 1; ((volatile uint32_t*)h->stripes[s].writers)[k]; spins++) {
+                if (!(spins % 1000))
+                    reclaim_writer(map, s, k);
+                else
+                    sched_yield();
+            }
+
+    // Build the grown map next to the old one
+    struct shared_map new = *map;
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s.new", map->path) >= sizeof(path))
+        die("shared map path '%s' is too long", map->path);
+    unlink(path);
+    init_file(&new, real_open(path, O_CREAT | O_WRONLY, 0644), count);
+    shared_map_open(&new, path);
+
+    // Reinsert every published entry.  Nobody else can see the new file yet.
+    struct header *nh = header(&new);
+    uint32_t i, j;
+    for (i = 0; i < old_count / GROUP_SIZE; i++) {
+        uint8_t *g = group(map, i);
+        for (j = 0; j < GROUP_SIZE; j++) {
+            if (g[j] & CTRL_PUBLISHED) {
+                struct entry *e = group_entry(map, g, j);
+                struct slot slot;
+                probe(&new, &e->key, &slot);
+                if (!slot.ctrl)
+                    die("shared_map %s: stripe overflow during growth", map->name);
+                memcpy(slot.entry, e, map->entry_size);
+                *slot.ctrl = g[j];
+                nh->stripes[key_stripe(&new, &e->key)].filled++;
+                nh->filled++;
+            }
+        }
+    }
+
+    // Swap the new map into place and send everyone else after it
+    if (real_rename(path, map->path) < 0)
+        die("shared_map %s: rename to %s failed: %s", map->name, map->path, strerror(errno));
+    munmap(new.addr, new.size);
+    __sync_synchronize();
+    h->replaced = 1;
+    h->generation++;
+    unlock_all(map);
+    map_file(map);
+}
 
 int shared_map_lookup(struct shared_map *map, const struct hash *key, void **value, int create)
 {
@@ -70,48 +550,319 @@ int shared_map_lookup(struct shared_map *map, const struct hash *key, void **val
         die("called shared_map_lookup without lock");
     if (!map->count)
         die("shared_map_lookup called before init");
+    if (map->stripe != NO_STRIPE)
+        die("shared_map_lookup: only one lookup is allowed per lock");
+    if (map->immutable)
+        die("shared_map_lookup called on immutable map %s", map->name);
 
-    // Use the first few bytes of the hash key mod count as the index.  key is a
-    // cryptographic hash, so the first few bytes are a good hash index.  We use
-    // native little endian order for speed.
-    // TODO: on big endian machines, we'll have to swap bytes here
-    uint32_t index = *(uint32_t*)key % map->count;
-
-    // Use linear chaining to find either key or the next free entry
-    uint32_t count = 0;
     for (;;) {
-        struct entry *entry = map->addr + map->entry_size * index;
-        if (hash_is_null(&entry->key)) {
-            if (create) {
-                // TODO: keep track of filled entries and occasionally resize
-                entry->key = *key;
-                *value = entry->value;
-            }
+        uint32_t s = lock_key(map, key);
+        map->stripe = s;
+
+        struct slot slot;
+        if (probe(map, key, &slot)) {
+            *value = slot.entry->value;
+            return 1;
+        }
+        else if (!create)
             return 0;
+
+        struct header *h = header(map);
+        struct stripe *stripe = h->stripes + s;
+        if (slot.ctrl && !stripe_full(map, stripe)) {
+            slot.entry->key = *key;
+            *slot.ctrl = fingerprint(key);
+            stripe->filled++;
+            __sync_fetch_and_add(&h->filled, 1);
+            *value = slot.entry->value;
+            return 0;
+        }
+
+        // The stripe is too full: drop our lock, grow, and try again
+        unlock_stripe(map, s);
+        map->stripe = NO_STRIPE;
+        grow(map, map->count);
+    }
+}
+
+// Begin a lock free operation on an immutable map.  Returns the generation,
+// which is even.
+static uint32_t begin_lock_free(struct shared_map *map)
+{
+    int spins;
+    for (spins = 1;; spins++) {
+        struct header *h = header(map);
+        if (h->replaced)
+            map_file(map);
+        h = header(map);
+        uint32_t generation = *(volatile uint32_t*)&h->generation;
+        if (!(generation & 1) && !h->replaced) {
+            __sync_synchronize();
+            return generation;
+        }
+
+        // A grower that died midway leaves the generation odd, so check
+        // occasionally whether it is still alive and take over if not
+        uint32_t grower = h->grower;
+        if (!(spins % 1000) && kill(grower, 0) < 0 && errno == ESRCH)
+            grow(map, map->count);
+        else
+            sched_yield();
+    }
+}
+
+// Has the map grown since begin_lock_free?
+static int end_lock_free(struct shared_map *map, uint32_t generation)
+{
+    __sync_synchronize();
+    return *(volatile uint32_t*)&header(map)->generation == generation;
+}
+
+int shared_map_read(struct shared_map *map, const struct hash *key, void *value)
+{
+    if (map->lock_held)
+        die("called shared_map_read with lock held");
+
+    if (map->immutable) {
+        // Published values never change, so only growth can get in our way
+        for (;;) {
+            uint32_t generation = begin_lock_free(map);
+            struct slot slot;
+            int found = probe(map, key, &slot);
+            if (found)
+                memcpy(value, slot.entry->value, map->value_size);
+            if (end_lock_free(map, generation))
+                return found;
+        }
+    }
+
+    int spins;
+    for (spins = 1;; spins++) {
+        struct header *h = header(map);
+        if (h->replaced)
+            map_file(map);
+        h = header(map);
+
+        uint32_t s = key_stripe(map, key);
+        volatile uint32_t *seq = &h->stripes[s].seq;
+        uint32_t start = *seq;
+        if (start & 1) {
+            // If the writer has died, locking the stripe steals it and
+            // evens out the sequence count
+            if (!(spins % 1000)) {
+                lock_stripe(map, s);
+                unlock_stripe(map, s);
+            }
+            else
+                sched_yield();
+            continue;
         }
-        else if (hash_equal(&entry->key, key)) {
-            *value = entry->value;
+        __sync_synchronize();
+
+        struct slot slot;
+        int found = probe(map, key, &slot);
+        if (found)
+            memcpy(value, slot.entry->value, map->value_size);
+
+        // If anyone wrote to the stripe in the meantime, try again
+        __sync_synchronize();
+        if (*seq == start && !h->replaced)
+            return found;
+    }
+}
+
+// Number of keys shared_map_read_many prefetches ahead of resolving them.
+// Enough to cover memory latency without evicting our own prefetches.
+#define PREFETCH_BATCH 16
+
+int shared_map_read_many(struct shared_map *map, int n, const struct hash keys[], void *values, char found[])
+{
+    int i, j, total = 0;
+    for (i = 0; i < n; i += PREFETCH_BATCH) {
+        int m = min(n - i, PREFETCH_BATCH);
+        // Prefetching never faults, so it's harmless if the map is stale
+        for (j = i; j < i + m; j++)
+            __builtin_prefetch(group(map, home_group(map, keys + j)));
+        for (j = i; j < i + m; j++)
+            total += found[j] = shared_map_read(map, keys + j, (char*)values + (size_t)j * map->value_size);
+    }
+    return total;
+}
+
+// Register as a lock free writer in the stripe of key, waiting out any growth.
+// grow bumps the generation before waiting for writers, so one of us always
+// sees the other.  Returns the stripe, and the writer slot in *k.
+static struct stripe *begin_write(struct shared_map *map, const struct hash *key, uint32_t *k)
+{
+    uint32_t pid = getpid();
+    int spins;
+    for (spins = 1;; spins++) {
+        uint32_t generation = begin_lock_free(map);
+        uint32_t s = key_stripe(map, key);
+        struct stripe *stripe = header(map)->stripes + s;
+        uint32_t i;
+        for (i = 0; i < WRITER_SLOTS; i++)
+            if (!stripe->writers[i] && __sync_bool_compare_and_swap(&stripe->writers[i], 0, pid))
+                break;
+        if (i == WRITER_SLOTS) {
+            // Every slot is busy, so wait, checking now and then for dead writers
+            if (!(spins % 1000))
+                reclaim_writers(map, s);
+            else
+                sched_yield();
+            continue;
+        }
+        if (end_lock_free(map, generation)) {
+            *k = i;
+            return stripe;
+        }
+        __sync_lock_release(&stripe->writers[i]);
+    }
+}
+
+static inline void end_write(struct stripe *stripe, uint32_t k)
+{
+    __sync_lock_release(&stripe->writers[k]);
+}
+
+int shared_map_insert(struct shared_map *map, const struct hash *key, const void *value, void *existing)
+{
+    if (!map->immutable)
+        die("shared_map_insert called on mutable map %s", map->name);
+    if (map->lock_held)
+        die("called shared_map_insert with lock held");
+
+    int spins;
+    for (spins = 1;; spins++) {
+        uint32_t k;
+        struct stripe *stripe = begin_write(map, key, &k);
+        struct slot slot;
+        if (probe(map, key, &slot)) {
+            if (existing)
+                memcpy(existing, slot.entry->value, map->value_size);
+            end_write(stripe, k);
             return 1;
         }
-        index = (index + 1) % map->count; 
-        count++;
-        if (++count == map->count)
-            die("shared_map %s filled with %d entries", map->name, count);
+        else if (slot.claimed) {
+            // A claimed entry might be our key, so wait for it to be published,
+            // checking now and then whether its inserter died
+            end_write(stripe, k);
+            if (!(spins % 1000))
+                reclaim_writers(map, key_stripe(map, key));
+            else
+                sched_yield();
+            continue;
+        }
+        else if (slot.ctrl && !stripe_full(map, stripe)) {
+            if (!__sync_bool_compare_and_swap(slot.ctrl, CTRL_EMPTY, CTRL_CLAIMED + k)) {
+                // Someone beat us to it, so look again
+                end_write(stripe, k);
+                continue;
+            }
+            slot.entry->key = *key;
+            memcpy(slot.entry->value, value, map->value_size);
+            __sync_synchronize();
+            *(volatile uint8_t*)slot.ctrl = fingerprint(key);
+            __sync_fetch_and_add(&stripe->filled, 1);
+            __sync_fetch_and_add(&header(map)->filled, 1);
+            end_write(stripe, k);
+            return 0;
+        }
+
+        // The stripe is too full: grow and try again
+        end_write(stripe, k);
+        grow(map, map->count);
+    }
+}
+
+int shared_map_touch(struct shared_map *map, const struct hash *key, size_t offset, uint32_t word)
+{
+    if (!map->immutable)
+        die("shared_map_touch called on mutable map %s", map->name);
+    if (offset + sizeof(uint32_t) > map->value_size)
+        die("shared_map_touch: offset %d is out of range", (int)offset);
+
+    // Register as a writer so that growth can't move the entry under us
+    uint32_t k;
+    struct stripe *stripe = begin_write(map, key, &k);
+    struct slot slot;
+    int found = probe(map, key, &slot);
+    if (found)
+        *(volatile uint32_t*)(slot.entry->value + offset) = word;
+    end_write(stripe, k);
+    return found;
+}
+
+int shared_map_compact(struct shared_map *map, int (*keep)(const struct hash *key, const void *value))
+{
+    if (map->lock_held)
+        die("called shared_map_compact with lock held");
+
+    // Build the new map next to the old one
+    struct shared_map new = *map;
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s.new", map->path) >= sizeof(path))
+        die("shared map path '%s' is too long", map->path);
+    unlink(path);
+    shared_map_init(&new, real_open(path, O_CREAT | O_WRONLY, 0644));
+    shared_map_open(&new, path);
+
+    int kept = 0;
+    uint32_t i, j;
+    for (i = 0; i < map->count / GROUP_SIZE; i++) {
+        uint8_t *g = group(map, i);
+        for (j = 0; j < GROUP_SIZE; j++) {
+            struct entry *e = group_entry(map, g, j);
+            if (!(g[j] & CTRL_PUBLISHED) || !keep(&e->key, e->value))
+                continue;
+            kept++;
+            if (map->immutable)
+                shared_map_insert(&new, &e->key, e->value, 0);
+            else {
+                void *value;
+                shared_map_lock(&new);
+                shared_map_lookup(&new, &e->key, &value, 1);
+                memcpy(value, e->value, map->value_size);
+                shared_map_unlock(&new);
+            }
+        }
     }
+
+    // Swap the new map into place
+    if (real_rename(path, map->path) < 0)
+        die("shared_map_compact: rename to %s failed: %s", map->path, strerror(errno));
+    munmap(new.addr, new.size);
+    header(map)->replaced = 1;
+    map_file(map);
+    return kept;
+}
+
+uint64_t shared_map_entry_bytes(struct shared_map *map)
+{
+    if (header(map)->replaced)
+        map_file(map);
+    return map->size / max(header(map)->filled, 1);
 }
 
 int shared_map_iter(struct shared_map *map, int (*f)(const struct hash *key, void *value))
 {
     if (!map->lock_held)
         die("called shared_map_iter without lock");
+    if (map->stripe != NO_STRIPE)
+        die("called shared_map_iter after shared_map_lookup");
+    lock_all(map);
+    map->stripe = ALL_STRIPES;
 
-    uint32_t index;
-    for (index = 0; index < map->count; index++) {
-        struct entry *entry = map->addr + map->entry_size * index;
-        if (!hash_is_null(&entry->key)) {
-            int r = f(&entry->key, entry->value);
-            if (r)
-                return r;
+    uint32_t i, j;
+    for (i = 0; i < map->count / GROUP_SIZE; i++) {
+        uint8_t *g = group(map, i);
+        for (j = 0; j < GROUP_SIZE; j++) {
+            if (g[j] & CTRL_PUBLISHED) {
+                struct entry *e = group_entry(map, g, j);
+                int r = f(&e->key, e->value);
+                if (r)
+                    return r;
+            }
         }
     }
 
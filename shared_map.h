@@ -4,14 +4,20 @@
 #define __shared_map_h__
 
 #include "hash.h"
+#include "arch.h"
 
 // A shared map maps a hash value to a fixed size data structure.
 // Each map is stored in $WAITLESS_DIR/<name> and is shared between
 // all waitless children processes via mmap.  A shared map consists of
-// a series of fixed size (hash, entry) arranged in hash order.  Our keys
-// are already cryptographic hashes so further hashing is unnecessary.
+// a small header followed by cache line aligned groups of fixed size
+// (hash, entry) pairs arranged in hash order.  Our keys are already cryptographic hashes so further
+// hashing is unnecessary.
 //
-// TODO: add locking
+// Maps start with default_count entries (a power of two) and double in size
+// whenever one of their stripes becomes 7/8 full (see shared_map.c).  The
+// process that grows a map rehashes it into a new file and renames that over
+// the old one, and other processes remap the file the next time they lock it,
+// so value pointers are only valid while the lock is held.
 //
 // TODO: I'm currently assuming that munmap is unnecessary since it happens
 // automatically on exit.
@@ -22,14 +28,23 @@ struct shared_map
     char name[20];
     uint32_t value_size;
     uint32_t default_count;
+    char immutable; // values never change after insertion (see shared_map_insert)
 
     // Computed header information (a function of the above)
     uint32_t entry_size;
 
     // Dynamic information (size, mmap address, etc.)
     uint32_t count; // number of entries in the hash table (filled or unfilled)
+    uint32_t group_bytes; // size of each group of entries (see shared_map.c)
+    uint32_t group_mask; // number of groups - 1
+    uint32_t stripe_shift; // log2 of the number of groups per stripe
+    char path[PATH_MAX];
     void *addr;
+    size_t size; // size of the mapping in bytes
+    dev_t dev; // identity of the mapped file, to notice if it was replaced
+    ino_t ino;
     char lock_held; // for assertions only
+    int stripe; // stripe locked by this process, if any
 };
 
 // Initialize the shared map pointed to by fd if it doesn't already exist.
@@ -39,10 +54,11 @@ extern void shared_map_init(const struct shared_map *map, int fd);
 // Map an existing shared map into our addresses space.
 extern void shared_map_open(struct shared_map *map, const char *path);
 
-// Lock or unlock a shared map.  For now, this will be rather slow since there's
-// only one lock per map, but that will be easy to fix later.
-//
-// TODO: Implement these, and add reader/writer locking if we think it's useful.
+// Lock or unlock a shared map.  Locking is striped: shared_map_lock only
+// begins a critical section, and the following shared_map_lookup or
+// shared_map_iter takes the lock for the key's stripe or the whole map,
+// respectively.  Only one lookup is allowed per critical section, and
+// shared_map_unlock releases whatever was taken.
 extern void shared_map_lock(struct shared_map *map);
 extern void shared_map_unlock(struct shared_map *map);
 
@@ -52,6 +68,40 @@ extern void shared_map_unlock(struct shared_map *map);
 // created values are zero initialized.
 extern int shared_map_lookup(struct shared_map *map, const struct hash *key, void **value, int create);
 
+// Look up a key without locking, copying the value out if it exists.  The read
+// is retried until it sees a consistent entry, so this is the fast path for
+// maps that are mostly read.  Must be called outside a critical section.
+extern int shared_map_read(struct shared_map *map, const struct hash *key, void *value);
+
+// shared_map_read for n keys at once.  The home groups of the keys are
+// prefetched before they are resolved, so that the cache misses overlap.
+// values holds n values, and found[i] is set iff key i was found.  Returns the
+// number of keys found.
+extern int shared_map_read_many(struct shared_map *map, int n, const struct hash keys[], void *values, char found[]);
+
+// Insert a key into an immutable map without locking.  If the key already
+// exists, shared_map_insert returns true and copies the existing value into
+// existing (if nonnull).  Otherwise it inserts value and returns false.
+// Immutable maps support only shared_map_insert, shared_map_read and
+// shared_map_iter, all of which are lock free except during growth.
+extern int shared_map_insert(struct shared_map *map, const struct hash *key, const void *value, void *existing);
+
+// Store a 32-bit word at the given byte offset of the value for key in an
+// immutable map, returning false if key isn't there.  This is for advisory
+// fields such as usage times, where racing stores are harmless; the rest of
+// the value remains immutable.
+extern int shared_map_touch(struct shared_map *map, const struct hash *key, size_t offset, uint32_t word);
+
+// Rewrite a map keeping only the entries for which keep returns true, and
+// swap the result into place.  This must not run concurrently with any other
+// process using the map, since they would keep using the old file.  Returns
+// the number of entries kept.
+extern int shared_map_compact(struct shared_map *map, int (*keep)(const struct hash *key, const void *value));
+
+// The size of the map's file divided by its number of filled entries, which is
+// what an entry costs on disk once the header and empty entries are counted.
+extern uint64_t shared_map_entry_bytes(struct shared_map *map);
+
 // Iterate over the entries of a shared_map, stopping if the iteration function
 // has a nonzero result (and returning that value if so).
 extern int shared_map_iter(struct shared_map *map, int (*f)(const struct hash *key, void *value));
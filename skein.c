@@ -43,6 +43,34 @@ int Skein_512_Init(Skein_512_Ctxt_t *ctx, size_t hashBitLen)
     return SKEIN_SUCCESS;
     }
 
+/*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+/* init the context for a tree hash operation (no key) */
+int Skein_512_InitExt(Skein_512_Ctxt_t *ctx, size_t hashBitLen, uint64_t treeInfo)
+    {
+    uint64_t cfg[SKEIN_512_STATE_WORDS];     /* config block */
+
+    /* no key: use all zeroes as key for config block */
+    memset(ctx->X,0,sizeof(ctx->X));
+
+    /* build/process the config block, type == CONFIG */
+    ctx->h.hashBitLen = hashBitLen;             /* output hash bit count */
+    Skein_Start_New_Type(ctx,CFG_FINAL);
+
+    memset(cfg,0,sizeof(cfg));                  /* pre-pad cfg[] with zeroes */
+    cfg[0] = htole64(SKEIN_SCHEMA_VER);
+    cfg[1] = htole64(hashBitLen);               /* hash result length in bits */
+    cfg[2] = htole64(treeInfo);                 /* tree hash config info (or SKEIN_CFG_TREE_INFO_SEQUENTIAL) */
+
+    /* compute the initial chaining values from config block */
+    Skein_512_Process_Block(ctx,(const uint8_t*)cfg,1,SKEIN_CFG_STR_LEN);
+
+    /* The chaining vars ctx->X are now initialized */
+    /* Set up to process the data message portion of the hash (default) */
+    Skein_Start_New_Type(ctx,MSG);
+
+    return SKEIN_SUCCESS;
+    }
+
 /*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
 /* process the input bytes */
 int Skein_512_Update(Skein_512_Ctxt_t *ctx, const uint8_t *msg, size_t msgByteCnt)
@@ -89,9 +117,6 @@ int Skein_512_Update(Skein_512_Ctxt_t *ctx, const uint8_t *msg, size_t msgByteCn
 /* finalize the hash computation and output the result */
 int Skein_512_Final(Skein_512_Ctxt_t *ctx, uint8_t *hashVal)
     {
-    size_t i,n,byteCnt;
-    uint64_t X[SKEIN_512_STATE_WORDS];
-
     ctx->h.T[1] |= SKEIN_T1_FLAG_FINAL;                 /* tag as the final block */
     if (ctx->h.bCnt < SKEIN_512_BLOCK_BYTES)            /* zero pad b[] if necessary */
         memset(&ctx->b[ctx->h.bCnt],0,SKEIN_512_BLOCK_BYTES - ctx->h.bCnt);
@@ -99,6 +124,28 @@ int Skein_512_Final(Skein_512_Ctxt_t *ctx, uint8_t *hashVal)
     Skein_512_Process_Block(ctx,ctx->b,1,ctx->h.bCnt);  /* process the final block */
     
     /* now output the result */
+    return Skein_512_Output(ctx,hashVal);
+    }
+
+/*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+/* finalize the hash computation and output the block, no OUTPUT stage */
+int Skein_512_Final_Pad(Skein_512_Ctxt_t *ctx, uint8_t *hashVal)
+    {
+    ctx->h.T[1] |= SKEIN_T1_FLAG_FINAL;        /* tag as the final block */
+    if (ctx->h.bCnt < SKEIN_512_BLOCK_BYTES)   /* zero pad b[] if necessary */
+        memset(&ctx->b[ctx->h.bCnt],0,SKEIN_512_BLOCK_BYTES - ctx->h.bCnt);
+    Skein_512_Process_Block(ctx,ctx->b,1,ctx->h.bCnt);    /* process the final block */
+    memcpy_htole64(hashVal,ctx->X,SKEIN_512_BLOCK_BYTES);  /* "output" the state bytes */
+    return SKEIN_SUCCESS;
+    }
+
+/*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+/* just do the OUTPUT stage */
+int Skein_512_Output(Skein_512_Ctxt_t *ctx, uint8_t *hashVal)
+    {
+    size_t i,n,byteCnt;
+    uint64_t X[SKEIN_512_STATE_WORDS];
+
     byteCnt = (ctx->h.hashBitLen + 7) >> 3;             /* total number of output bytes */
 
     /* run Threefish in "counter mode" to generate output */
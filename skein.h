@@ -67,6 +67,33 @@ int  Skein_512_Init  (Skein_512_Ctxt_t *ctx, size_t hashBitLen);
 int  Skein_512_Update(Skein_512_Ctxt_t *ctx, const uint8_t *msg, size_t msgByteCnt);
 int  Skein_512_Final (Skein_512_Ctxt_t *ctx, uint8_t * hashVal);
 
+/*
+**   Skein APIs for tree hashing:
+**        Skein_512_InitExt() sets up the chaining variables for the given treeInfo
+**        (see SKEIN_CFG_TREE_INFO below).  Each tree node is then hashed by
+**        setting the tweak for its position and level, updating, and calling
+**        Skein_512_Final_Pad(), which outputs the full state block without the
+**        output stage.  Skein_512_Output() runs only the output stage, starting
+**        from chaining variables loaded from the root node.
+**/
+int  Skein_512_InitExt  (Skein_512_Ctxt_t *ctx, size_t hashBitLen, uint64_t treeInfo);
+int  Skein_512_Final_Pad(Skein_512_Ctxt_t *ctx, uint8_t * hashVal);
+int  Skein_512_Output   (Skein_512_Ctxt_t *ctx, uint8_t * hashVal);
+
+/* which Skein_512_Process_Block the build selected (see skein_block.c) */
+#if defined(SKEIN_USE_ASM) && (SKEIN_USE_ASM & 512)
+#define SKEIN_512_BLOCK_IMPL "x86-64 assembly"
+#else
+#define SKEIN_512_BLOCK_IMPL "C"
+#endif
+
+/*
+**   Multi-buffer hashing (skein_multi.c): hash n independent messages, writing
+**   the (hashBitLen+7)/8 byte results consecutively to hashVal.  Short messages
+**   are hashed several at a time in SIMD lanes where the CPU allows it.
+**/
+void Skein_512_Hash_Many(size_t hashBitLen, size_t n, const uint8_t *const msg[], const size_t len[], uint8_t *hashVal);
+
 /*****************************************************************
 ** "Internal" Skein definitions
 **    -- not needed for sequential hashing API, but will be 
@@ -0,0 +1,58 @@
+// Compare the Skein block function waitless was built with against the
+// portable C version, across message sizes
+
+#include "util.h"
+#include "skein.h"
+#include "real_call.h"
+#include <sys/time.h>
+
+// skein_block.o holds whichever version dmk selected, and skein_block_c.o
+// is skein_block.c rebuilt without SKEIN_USE_ASM under another name
+extern void Skein_512_Process_Block(Skein_512_Ctxt_t *ctx, const uint8_t *blkPtr, size_t blkCnt, size_t byteCntAdd);
+extern void Skein_512_Process_Block_C(Skein_512_Ctxt_t *ctx, const uint8_t *blkPtr, size_t blkCnt, size_t byteCntAdd);
+
+typedef void (*block_function)(Skein_512_Ctxt_t *ctx, const uint8_t *blkPtr, size_t blkCnt, size_t byteCntAdd);
+
+#define MAX_SIZE (1<<20)
+#define TOTAL (64<<20) // bytes to hash per measurement
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// Process size-byte messages until TOTAL bytes are done, returning MB/s and
+// leaving the final state in ctx
+static double run(block_function block, Skein_512_Ctxt_t *ctx, const uint8_t *data, size_t size)
+{
+    size_t blocks = size / SKEIN_512_BLOCK_BYTES, i;
+    double start = now();
+    for (i = 0; i < TOTAL / size; i++) {
+        Skein_512_Init(ctx, 128);
+        block(ctx, data, blocks, SKEIN_512_BLOCK_BYTES);
+    }
+    double elapsed = now() - start;
+    return elapsed > 0 ? TOTAL / elapsed / (1 << 20) : 0;
+}
+
+int main()
+{
+    static uint8_t data[MAX_SIZE];
+    size_t size;
+    for (size = 0; size < MAX_SIZE; size++)
+        data[size] = size * 2654435761u >> 24;
+
+    fdprintf(STDOUT_FILENO, "block function: %s\n", SKEIN_512_BLOCK_IMPL);
+    fdprintf(STDOUT_FILENO, "%10s %10s %10s\n", "bytes", "C MB/s", "MB/s");
+    for (size = SKEIN_512_BLOCK_BYTES; size <= MAX_SIZE; size *= 4) {
+        Skein_512_Ctxt_t c, a;
+        double before = run(Skein_512_Process_Block_C, &c, data, size);
+        double after = run(Skein_512_Process_Block, &a, data, size);
+        if (memcmp(c.X, a.X, sizeof(c.X)) || memcmp(c.h.T, a.h.T, sizeof(c.h.T)))
+            die("block functions disagree on %lu byte messages", (unsigned long)size);
+        fdprintf(STDOUT_FILENO, "%10lu %10d %10d\n", (unsigned long)size, (int)before, (int)after);
+    }
+    return 0;
+}
@@ -2,31 +2,269 @@
 
 #include "util.h"
 #include "hash.h"
+#include "hash_parallel.h"
+#include "skein.h"
 #include "real_call.h"
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+// Use explicit forward declarations to avoid bringing in all of stdlib.h and unistd.h
+extern int atoi(const char *s);
+extern void *malloc(size_t n);
+extern void *calloc(size_t count, size_t n);
+extern void free(void *p);
+extern long sysconf(int name);
+#ifdef __APPLE__
+#define _SC_NPROCESSORS_ONLN 58
+#else
+#define _SC_NPROCESSORS_ONLN 84
+#endif
+
+static void usage()
+{
+    write_str(STDERR_FILENO,
+        "usage: skein [options] <file>...\n"
+        "Print the hash of each file, in order.\n"
+        "\n"
+        "Options:\n"
+        "   -j, --jobs=N   hash N files at once (default 1)\n"
+        "   -t             compare throughput of one thread and all cpus\n"
+        "   -b             compare throughput of the hash backends on one thread\n"
+        "       --bench    report throughput by file size instead of printing hashes\n"
+        "   -h, --help     print this help message\n");
+    real__exit(1);
+}
+
+static int threads;
+static const struct hash_backend *backend;
+
+static void hash_fd_threads(struct hash *hash, int fd)
+{
+    hash_fd_parallel(hash, fd, threads);
+}
+
+static void hash_fd_with_backend(struct hash *hash, int fd)
+{
+    hash_fd_backend(backend, hash, fd);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+static double mb_per_second(double bytes, double seconds)
+{
+    return seconds > 0 ? bytes / seconds / (1 << 20) : 0;
+}
+
+// Hash path with the given method, returning the elapsed time and (if size
+// is nonnull) the file size
+static double timed_hash(struct hash *hash, const char *path, void (*method)(struct hash *hash, int fd), off_t *size)
+{
+    int fd = real_open(path, O_RDONLY, 0);
+    if (fd < 0)
+        die("can't open %s: %s", path, strerror(errno));
+    struct stat st;
+    if (real_fstat(fd, &st) < 0)
+        die("can't stat %s: %s", path, strerror(errno));
+    double start = now();
+    method(hash, fd);
+    double elapsed = now() - start;
+    real_close(fd);
+    if (size)
+        *size = st.st_size;
+    return elapsed;
+}
+
+static void print_hash(const struct hash *hash, const char *path)
+{
+    char buffer[1024], *p = buffer;
+    p = show_hash(p, sizeof(buffer), hash);
+    *p++ = ' ';
+    *p++ = ' ';
+    p += strlcpy(p, path, buffer+sizeof(buffer)-p-1);
+    *p++ = '\n';
+    write(STDOUT_FILENO, buffer, p-buffer);
+}
+
+/*
+ * -j: worker threads take files in turn, and the main thread prints each
+ * result as soon as it and all earlier ones are done.  Each file gets its
+ * share of the cpus for hash_fd_parallel.
+ */
+struct jobs
+{
+    char **paths;
+    int count;
+    int next; // next file to hash
+    struct hash *hashes;
+    char *done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void *job_worker(void *arg)
+{
+    struct jobs *jobs = arg;
+    for (;;) {
+        int i = __sync_fetch_and_add(&jobs->next, 1);
+        if (i >= jobs->count)
+            return 0;
+        int fd = real_open(jobs->paths[i], O_RDONLY, 0);
+        if (fd < 0)
+            die("can't open %s: %s", jobs->paths[i], strerror(errno));
+        hash_fd_parallel(jobs->hashes + i, fd, threads);
+        real_close(fd);
+
+        pthread_mutex_lock(&jobs->mutex);
+        jobs->done[i] = 1;
+        pthread_cond_broadcast(&jobs->cond);
+        pthread_mutex_unlock(&jobs->mutex);
+    }
+}
+
+static void hash_files(char **paths, int count, int njobs)
+{
+    struct jobs jobs = { paths, count, 0 };
+    jobs.hashes = malloc(count * sizeof(struct hash));
+    jobs.done = calloc(count, 1);
+    if (!jobs.hashes || !jobs.done)
+        die("skein: out of memory");
+    pthread_mutex_init(&jobs.mutex, 0);
+    pthread_cond_init(&jobs.cond, 0);
+
+    njobs = min(njobs, count);
+    threads = max(threads / njobs, 1);
+    pthread_t ids[njobs];
+    int i;
+    for (i = 0; i < njobs; i++)
+        if (pthread_create(ids + i, 0, job_worker, &jobs))
+            die("skein: pthread_create failed");
+
+    for (i = 0; i < count; i++) {
+        pthread_mutex_lock(&jobs.mutex);
+        while (!jobs.done[i])
+            pthread_cond_wait(&jobs.cond, &jobs.mutex);
+        pthread_mutex_unlock(&jobs.mutex);
+        print_hash(jobs.hashes + i, paths[i]);
+    }
+    for (i = 0; i < njobs; i++)
+        pthread_join(ids[i], 0);
+    free(jobs.hashes);
+    free(jobs.done);
+}
+
+/*
+ * --bench: hash each file once, the same way as without options, and total up
+ * bytes and time per power-of-16 size bucket.  The page cache is not flushed,
+ * so run twice to separate hashing speed from disk speed.
+ */
+#define BUCKETS 7 // < 4K, < 64K, < 1M, < 16M, < 256M, < 4G, larger
+
+static void bench(char **paths, int count)
+{
+    double bytes[BUCKETS] = {0}, seconds[BUCKETS] = {0};
+    int files[BUCKETS] = {0};
+    int i, b;
+    for (i = 0; i < count; i++) {
+        struct hash hash;
+        off_t size;
+        double elapsed = timed_hash(&hash, paths[i], hash_fd_threads, &size);
+        for (b = 0; b < BUCKETS - 1 && size >= (off_t)4096 << 4*b; b++)
+            ;
+        files[b]++;
+        bytes[b] += size;
+        seconds[b] += elapsed;
+    }
+
+    static const char *names[BUCKETS] = { "< 4K", "< 64K", "< 1M", "< 16M", "< 256M", "< 4G", ">= 4G" };
+    fdprintf(STDOUT_FILENO, "hash %s, block function %s, %d threads per file\n",
+        hash_backend->name, SKEIN_512_BLOCK_IMPL, threads);
+    fdprintf(STDOUT_FILENO, "%8s %8s %10s %8s\n", "size", "files", "MB", "MB/s");
+    for (b = 0; b < BUCKETS; b++)
+        if (files[b])
+            fdprintf(STDOUT_FILENO, "%8s %8d %10.1f %8d\n", names[b], files[b],
+                bytes[b] / (1 << 20), (int)mb_per_second(bytes[b], seconds[b]));
+}
 
 int main(int argc, char **argv)
 {
-    if (argc < 2 || argv[1][0] == '-') {
-        write_str(STDERR_FILENO, "usage: skein <file>...\n");
-        real__exit(1);
+    int compare_threads = 0;
+    int compare_backends = 0;
+    int bench_sizes = 0;
+    int njobs = 1;
+
+    const char *short_options = "+j:tbh";
+    struct option long_options[] = {
+        {"jobs",  required_argument, 0, 'j'},
+        {"bench", no_argument, 0, 'B'},
+        {"help",  no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    for (;;) {
+        int c = getopt_long(argc, argv, short_options, long_options, 0);
+        if (c == -1)
+            break;
+        switch (c) {
+            case 'j': njobs = max(atoi(optarg), 1); break;
+            case 't': compare_threads = 1; break;
+            case 'b': compare_backends = 1; break;
+            case 'B': bench_sizes = 1; break;
+            case 'h': usage();
+            default: return 1; // getopt_long already printed a message, so exit
+        }
+    }
+    if (optind == argc)
+        usage();
+    threads = max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    char **paths = argv + optind;
+    int count = argc - optind;
+    if (bench_sizes) {
+        bench(paths, count);
+        return 0;
+    }
+    if (!compare_threads && !compare_backends) {
+        hash_files(paths, count, njobs);
+        return 0;
     }
 
     int i;
-    for (i = 1; i < argc; i++) {
-        int fd = real_open(argv[i], O_RDONLY, 0);
-        if (fd < 0)
-            die("can't open %s: %s", argv[i], strerror(errno));
+    for (i = 0; i < count; i++) {
         struct hash hash;
-        hash_fd(&hash, fd);
-        real_close(fd);
-        char buffer[1024], *p = buffer;
-        p = show_hash(p, sizeof(buffer), &hash); 
-        *p++ = ' ';
-        *p++ = ' ';
-        p += strlcpy(p, argv[i], buffer+sizeof(buffer)-p-1);
-        *p++ = '\n';
-        write(STDERR_FILENO, buffer, p-buffer);
+        off_t size;
+        if (compare_backends) {
+            const struct hash_backend *backends[] = { &hash_skein, &hash_blake3 };
+            int b;
+            for (b = 0; b < sizeof(backends) / sizeof(*backends); b++) {
+                struct hash other;
+                backend = backends[b];
+                timed_hash(&other, paths[i], hash_fd_with_backend, 0); // warm the page cache
+                double elapsed = timed_hash(&other, paths[i], hash_fd_with_backend, &size);
+                fdprintf(STDERR_FILENO, "%s: %d MB/s with %s\n", paths[i],
+                    (int)mb_per_second(size, elapsed), backend->name);
+                if (backend == hash_backend)
+                    hash = other;
+            }
+        }
+        else {
+            // Hash with one thread first, which also warms the page cache
+            struct hash single;
+            timed_hash(&single, paths[i], hash_fd, 0);
+            double before = timed_hash(&single, paths[i], hash_fd, &size);
+            double after = timed_hash(&hash, paths[i], hash_fd_threads, 0);
+            if (!hash_equal(&hash, &single))
+                die("%s: serial and parallel hashes disagree", paths[i]);
+            fdprintf(STDERR_FILENO, "%s: %d MB/s with one thread, %d MB/s with %d threads\n", paths[i],
+                (int)mb_per_second(size, before), (int)mb_per_second(size, after), threads);
+        }
+        print_hash(&hash, paths[i]);
     }
     return 0;
 }
@@ -0,0 +1,233 @@
+/***********************************************************************
+**
+** Multi-buffer Skein-512: hash several independent short messages at
+** once, one message per 64-bit SIMD lane.
+**
+** The block function is the same as Skein_512_Process_Block, written over
+** GCC vector types so that the compiler emits AVX2 (4 lanes) or AVX-512
+** (8 lanes) code.  The lane count is picked at runtime from what the CPU
+** supports; without SIMD, or for long messages, we fall back to the
+** portable code in skein.c and skein_block.c.
+**
+************************************************************************/
+
+#include <string.h>
+#include "skein.h"
+#include "endian.h"
+#include "util.h"
+
+#define MULTI_MAX_BLOCKS 4  /* longer messages use the scalar code */
+#define MULTI_MAX_LANES  8
+
+static void hash_one(size_t hashBitLen, const uint8_t *msg, size_t len, uint8_t *hashVal)
+    {
+    Skein_512_Ctxt_t ctx;
+    Skein_512_Init(&ctx,hashBitLen);
+    Skein_512_Update(&ctx,msg,len);
+    Skein_512_Final(&ctx,hashVal);
+    }
+
+/* number of blocks Skein processes for a message, counting the final one */
+static size_t block_count(size_t len)
+    {
+    return len ? (len + SKEIN_512_BLOCK_BYTES - 1) / SKEIN_512_BLOCK_BYTES : 1;
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+typedef uint64_t v4 __attribute__((vector_size(32)));
+typedef uint64_t v8 __attribute__((vector_size(64)));
+
+#define MROTL(x,n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+#define MR512(p0,p1,p2,p3,p4,p5,p6,p7,ROT)                                 \
+    X[p0] += X[p1]; X[p1] = MROTL(X[p1],ROT##_0); X[p1] ^= X[p0];           \
+    X[p2] += X[p3]; X[p3] = MROTL(X[p3],ROT##_1); X[p3] ^= X[p2];           \
+    X[p4] += X[p5]; X[p5] = MROTL(X[p5],ROT##_2); X[p5] ^= X[p4];           \
+    X[p6] += X[p7]; X[p7] = MROTL(X[p7],ROT##_3); X[p7] ^= X[p6];
+
+/* key injection number s */
+#define MI512(s)                                                            \
+    X[0] += ks[((s)+0)%9];                                                  \
+    X[1] += ks[((s)+1)%9];                                                  \
+    X[2] += ks[((s)+2)%9];                                                  \
+    X[3] += ks[((s)+3)%9];                                                  \
+    X[4] += ks[((s)+4)%9];                                                  \
+    X[5] += ks[((s)+5)%9] + ts[(s)%3];                                      \
+    X[6] += ks[((s)+6)%9] + ts[((s)+1)%3];                                  \
+    X[7] += ks[((s)+7)%9] + (uint64_t)(s);
+
+#define MR512_8_rounds(R)                                                   \
+    MR512(0,1,2,3,4,5,6,7,R_512_0)                                          \
+    MR512(2,1,4,7,6,5,0,3,R_512_1)                                          \
+    MR512(4,1,6,3,0,5,2,7,R_512_2)                                          \
+    MR512(6,1,0,7,2,5,4,3,R_512_3)                                          \
+    MI512(2*(R)+1)                                                          \
+    MR512(0,1,2,3,4,5,6,7,R_512_4)                                          \
+    MR512(2,1,4,7,6,5,0,3,R_512_5)                                          \
+    MR512(4,1,6,3,0,5,2,7,R_512_6)                                          \
+    MR512(6,1,0,7,2,5,4,3,R_512_7)                                          \
+    MI512(2*(R)+2)
+
+#if SKEIN_512_ROUNDS_TOTAL != 72
+#error "multi-buffer Skein assumes 72 rounds"
+#endif
+
+/* process one block in every lane: C[] holds the chaining vars, w[] the
+** message words, and t0/t1 the tweak */
+#define MBLOCK(VEC)                                                         \
+    {                                                                       \
+    VEC ks[9], ts[3], X[8];                                                 \
+    ks[8] = C[0] ^ SKEIN_KS_PARITY;                                         \
+    for (j=0;j<8;j++)                                                       \
+        {                                                                   \
+        ks[j] = C[j];                                                       \
+        if (j) ks[8] ^= C[j];                                               \
+        }                                                                   \
+    ts[0] = t0;                                                             \
+    ts[1] = t1;                                                             \
+    ts[2] = ts[0] ^ ts[1];                                                  \
+    for (j=0;j<8;j++)                                                       \
+        X[j] = w[j] + ks[j];                                                \
+    X[5] += ts[0];                                                          \
+    X[6] += ts[1];                                                          \
+    MR512_8_rounds(0) MR512_8_rounds(1) MR512_8_rounds(2)                   \
+    MR512_8_rounds(3) MR512_8_rounds(4) MR512_8_rounds(5)                   \
+    MR512_8_rounds(6) MR512_8_rounds(7) MR512_8_rounds(8)                   \
+    for (j=0;j<8;j++)                                                       \
+        C[j] = X[j] ^ w[j];                                                 \
+    }
+
+/* Hash LANES messages which all take the same number of blocks, leaving
+** the output stage chaining vars of lane l in out[l] */
+#define SKEIN_MULTI(NAME,VEC,LANES,TARGET)                                  \
+__attribute__((target(TARGET)))                                             \
+static void NAME(const uint8_t *const msg[], const size_t len[], size_t blocks, \
+                 const uint64_t iv[SKEIN_512_STATE_WORDS],                  \
+                 uint64_t out[][SKEIN_512_STATE_WORDS])                     \
+    {                                                                       \
+    VEC C[8], w[8], t0, t1, zero = {0};                                     \
+    uint64_t block[SKEIN_512_STATE_WORDS];                                  \
+    size_t b,j,l;                                                           \
+    for (j=0;j<8;j++)                                                       \
+        for (l=0;l<LANES;l++)                                               \
+            C[j][l] = iv[j];                                                \
+                                                                            \
+    /* message blocks */                                                    \
+    for (b=0;b<blocks;b++)                                                  \
+        {                                                                   \
+        for (l=0;l<LANES;l++)                                               \
+            {                                                               \
+            size_t start = b*SKEIN_512_BLOCK_BYTES;                         \
+            size_t n = min(len[l] - start, (size_t)SKEIN_512_BLOCK_BYTES);  \
+            memset(block,0,sizeof(block));                                  \
+            memcpy(block,msg[l] + start,n);                                 \
+            for (j=0;j<8;j++)                                               \
+                w[j][l] = letoh64(block[j]);                                \
+            t0[l] = start + n;                                              \
+            t1[l] = SKEIN_T1_BLK_TYPE_MSG                                   \
+                  | (b == 0 ? SKEIN_T1_FLAG_FIRST : 0)                      \
+                  | (b == blocks-1 ? SKEIN_T1_FLAG_FINAL : 0);              \
+            }                                                               \
+        MBLOCK(VEC)                                                         \
+        }                                                                   \
+                                                                            \
+    /* output stage: a single counter block of zero */                      \
+    for (j=0;j<8;j++)                                                       \
+        w[j] = zero;                                                        \
+    t0 = zero + sizeof(uint64_t);                                           \
+    t1 = zero + (SKEIN_T1_FLAG_FIRST | SKEIN_T1_BLK_TYPE_OUT_FINAL);        \
+    MBLOCK(VEC)                                                             \
+    for (l=0;l<LANES;l++)                                                   \
+        for (j=0;j<8;j++)                                                   \
+            out[l][j] = C[j][l];                                            \
+    }
+
+SKEIN_MULTI(skein_512_multi_4,v4,4,"avx2")
+SKEIN_MULTI(skein_512_multi_8,v8,8,"avx512f")
+
+/* How many lanes does this CPU support? */
+static int lane_count(void)
+    {
+    static int lanes = 0;
+    if (!lanes)
+        {
+        __builtin_cpu_init();
+        lanes = __builtin_cpu_supports("avx512f") ? 8
+              : __builtin_cpu_supports("avx2") ? 4 : 1;
+        }
+    return lanes;
+    }
+
+/* Hash count <= lanes messages from the given indices, all taking the same
+** number of blocks.  Unused lanes repeat the first message. */
+static void hash_group(int lanes, size_t hashBitLen, const uint64_t *iv, const uint8_t *const msg[],
+                       const size_t len[], const size_t index[], int count, size_t blocks, uint8_t *hashVal)
+    {
+    const uint8_t *m[MULTI_MAX_LANES];
+    size_t n[MULTI_MAX_LANES];
+    uint64_t out[MULTI_MAX_LANES][SKEIN_512_STATE_WORDS];
+    size_t bytes = (hashBitLen + 7) >> 3;
+    int l;
+    for (l=0;l<lanes;l++)
+        {
+        size_t i = index[l < count ? l : 0];
+        m[l] = msg[i];
+        n[l] = len[i];
+        }
+    if (lanes == 8)
+        skein_512_multi_8(m,n,blocks,iv,out);
+    else
+        skein_512_multi_4(m,n,blocks,iv,out);
+    for (l=0;l<count;l++)
+        memcpy_htole64(hashVal + index[l]*bytes,out[l],bytes);
+    }
+
+#endif
+
+/*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+/* hash n independent messages, writing the results consecutively to hashVal */
+void Skein_512_Hash_Many(size_t hashBitLen, size_t n, const uint8_t *const msg[], const size_t len[], uint8_t *hashVal)
+    {
+    size_t bytes = (hashBitLen + 7) >> 3;
+    size_t i;
+#if defined(__x86_64__) && defined(__GNUC__)
+    int lanes = lane_count();
+    if (lanes > 1 && n > 1)
+        {
+        /* Skein_512_Init knows the precomputed IVs */
+        Skein_512_Ctxt_t ctx;
+        Skein_512_Init(&ctx,hashBitLen);
+
+        /* queue messages by block count until a group fills all lanes */
+        size_t pending[MULTI_MAX_BLOCKS+1][MULTI_MAX_LANES];
+        int count[MULTI_MAX_BLOCKS+1] = {0};
+        size_t b;
+        for (i=0;i<n;i++)
+            {
+            b = block_count(len[i]);
+            if (b > MULTI_MAX_BLOCKS)
+                {
+                hash_one(hashBitLen,msg[i],len[i],hashVal + i*bytes);
+                continue;
+                }
+            pending[b][count[b]++] = i;
+            if (count[b] == lanes)
+                {
+                hash_group(lanes,hashBitLen,ctx.X,msg,len,pending[b],lanes,b,hashVal);
+                count[b] = 0;
+                }
+            }
+
+        /* partial groups are still worth it unless they're a single message */
+        for (b=1;b<=MULTI_MAX_BLOCKS;b++)
+            if (count[b] > 1)
+                hash_group(count[b] > 4 ? lanes : 4,hashBitLen,ctx.X,msg,len,pending[b],count[b],b,hashVal);
+            else if (count[b])
+                hash_one(hashBitLen,msg[pending[b][0]],len[pending[b][0]],hashVal + pending[b][0]*bytes);
+        return;
+        }
+#endif
+    for (i=0;i<n;i++)
+        hash_one(hashBitLen,msg[i],len[i],hashVal + i*bytes);
+    }
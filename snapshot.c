@@ -9,8 +9,8 @@
 #include "stat_cache.h"
 #include <errno.h>
 
-// TODO: Rethink default counts and make them resizable
-struct shared_map snapshot = { "snapshot.XXXXXXX", sizeof(struct snapshot_entry), 1<<15 };
+// Snapshots are per run and usually small, so start small and let them grow
+struct shared_map snapshot = { "snapshot.XXXXXXX", sizeof(struct snapshot_entry), 1<<10 };
 
 // TODO: thread safety
 void snapshot_init()
@@ -20,29 +20,28 @@ void snapshot_init()
         return;
     initialized = 1;
 
-    const char *waitless_snapshot = getenv(WAITLESS_SNAPSHOT);
-    if (!waitless_snapshot)
+    if (!waitless_env->snapshot)
         die("WAITLESS_SNAPSHOT not set");
-    shared_map_open(&snapshot, waitless_snapshot);
+    shared_map_open(&snapshot, waitless_env->snapshot);
 }
 
 void make_fresh_snapshot()
 {
-    const char *waitless_dir = getenv(WAITLESS_DIR);
-    if (!waitless_dir)
-        die("WAITLESS_DIR not set");
-
     char snapshot_path[PATH_MAX];
-    strcpy(snapshot_path, path_join(waitless_dir, "snapshot.XXXXXXX")); // TODO: one unnecessary copy
+    strcpy(snapshot_path, waitless_path("snapshot.XXXXXXX"));
     shared_map_init(&snapshot, mkstemp(snapshot_path));
-    setenv(WAITLESS_SNAPSHOT, snapshot_path, 1);
+    env_set(WAITLESS_SNAPSHOT, snapshot_path);
 }
 
 struct snapshot_entry *snapshot_update(struct hash *hash, const char *path, const struct hash *path_hash, int do_hash)
 {
     // Hash the file's contents or existence
     stat_cache_update(hash, path, path_hash, do_hash);
+    return snapshot_record(hash, path, path_hash);
+}
 
+struct snapshot_entry *snapshot_record(const struct hash *hash, const char *path, const struct hash *path_hash)
+{
     // Look up the path_hash in the snapshot to see if we know about the file
     snapshot_init();
     shared_map_lock(&snapshot);
@@ -118,22 +117,51 @@ void snapshot_dump()
     shared_map_unlock(&snapshot);
 }
 
+// snapshot_verify checks files in batches, so that the inverse map lookups
+// for their paths can overlap
+#define VERIFY_BATCH 32
+
+static struct verify_batch
+{
+    int n;
+    struct hash path_hashes[VERIFY_BATCH];
+    struct hash hashes[VERIFY_BATCH];
+} verify_batch;
+
+static void verify_flush()
+{
+    struct verify_batch *b = &verify_batch;
+    char paths[VERIFY_BATCH][PATH_MAX];
+    int sizes[VERIFY_BATCH], i;
+    inverse_hash_many(b->n, b->path_hashes, paths[0], PATH_MAX, sizes);
+
+    for (i = 0; i < b->n; i++) {
+        if (sizes[i] < 0)
+            die("snapshot_verify: unknown path hash");
+        const struct hash *expected = b->hashes + i;
+        int do_hash = !(hash_is_null(expected) || hash_is_all_one(expected));
+        struct hash hash;
+        stat_cache_update(&hash, paths[i], b->path_hashes + i, do_hash);
+        if (!hash_equal(&hash, expected)) {
+            char sh[8], fh[8];
+            show_hash(fh, 8, &hash);
+            show_hash(sh, 8, expected);
+            fdprintf(STDERR_FILENO, "warning: snapshot mismatch for %s: snapshot says %s, file says %s\n", paths[i], sh, fh);
+        }
+    }
+    b->n = 0;
+}
+
 static int verify_helper(const struct hash *path_hash, void *value)
 {
     struct snapshot_entry *entry = value;
     if (entry->writing)
         return 0;
-    char path[PATH_MAX];
-    inverse_hash_string(path_hash, path, sizeof(path));
-    int do_hash = !(hash_is_null(&entry->hash) || hash_is_all_one(&entry->hash));
-    struct hash hash;
-    stat_cache_update(&hash, path, path_hash, do_hash);
-    if (!hash_equal(&hash, &entry->hash)) {
-        char sh[8], fh[8];
-        show_hash(fh, 8, &hash);
-        show_hash(sh, 8, &entry->hash);
-        fdprintf(STDERR_FILENO, "warning: snapshot mismatch for %s: snapshot says %s, file says %s\n", path, sh, fh);
-    }
+    struct verify_batch *b = &verify_batch;
+    b->path_hashes[b->n] = *path_hash;
+    b->hashes[b->n] = entry->hash;
+    if (++b->n == VERIFY_BATCH)
+        verify_flush();
     return 0;
 }
 
@@ -141,6 +169,8 @@ void snapshot_verify()
 {
     snapshot_init();
     shared_map_lock(&snapshot);
+    verify_batch.n = 0;
     shared_map_iter(&snapshot, verify_helper);
+    verify_flush();
     shared_map_unlock(&snapshot);
 }
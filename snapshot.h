@@ -49,6 +49,11 @@ extern struct shared_map snapshot;
  */
 extern struct snapshot_entry *snapshot_update(struct hash *hash, const char *path, const struct hash *path_hash, int do_hash);
 
+// Same as snapshot_update, but for a file whose hash the caller already knows
+// (e.g., an existence hash from a memoized PATH search), so the stat cache
+// isn't consulted.
+extern struct snapshot_entry *snapshot_record(const struct hash *hash, const char *path, const struct hash *path_hash);
+
 extern void snapshot_dump();
 
 extern void snapshot_verify();
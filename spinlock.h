@@ -10,11 +10,15 @@
 
 static inline int xchg(volatile int *m, int x)
 {
+    // *m must be a read-write memory operand: with "=g", gcc is free to
+    // exchange with a register copy instead.  The memory clobber keeps the
+    // critical section from being moved outside the lock.
     int r;
-    __asm__ (
-        "xchg%z0 %2, %0"
-        : "=g"(*m), "=r"(r)
-        : "1"(x));
+    __asm__ __volatile__ (
+        "xchg%z0 %1, %0"
+        : "+m"(*m), "=r"(r)
+        : "1"(x)
+        : "memory");
     return r;
 }
 
@@ -41,6 +45,7 @@ static inline void spin_lock(spinlock_t *s)
 static inline void spin_unlock(spinlock_t *s)
 {
     //wlog("unlock 0x%x", s);
+    __asm__ __volatile__ ("" : : : "memory");
     s->lock = 0;
 }
 
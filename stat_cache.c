@@ -5,6 +5,8 @@
 #include "util.h"
 #include "real_call.h"
 #include "shared_map.h"
+#include "inverse_map.h"
+#include "watch.h"
 #include "errno.h"
 
 struct stat_cache_entry
@@ -14,19 +16,25 @@ struct stat_cache_entry
     struct timespec st_mtimespec; // last modification time
     off_t st_size;                // file size
 
-    // Last known hash of the file's contents
+    // Last known hash of the file's contents.  All zero if the file is known
+    // not to exist, in which case the stat information is that of the parent
+    // directory (see known_missing).
     struct hash contents_hash;
+
+    // Process currently hashing the file, or zero.  While a process is
+    // hashing, contents_hash is all one.
+    pid_t hashing;
+
+    // Watch epoch in which the entry was last verified, or zero.  If this
+    // matches the current epoch, the entry can be trusted without lstat.
+    uint32_t clean_epoch;
 };
 
-// TODO: Rethink default counts and make them resizable
 static struct shared_map stat_cache = { "stat_cache", sizeof(struct stat_cache_entry), 1<<15 };
 
 static const char *stat_cache_path()
 {
-    const char *waitless_dir = getenv(WAITLESS_DIR);
-    if (!waitless_dir)
-        die("WAITLESS_DIR not set");
-    return path_join(waitless_dir, stat_cache.name);
+    return waitless_path(stat_cache.name);
 }
 
 void stat_cache_init()
@@ -42,16 +50,312 @@ static void initialize()
         return;
     initialized = 1;
 
-    const char *waitless_dir = getenv(WAITLESS_DIR);
-    if (!waitless_dir)
-        die("WAITLESS_DIR not set");
     shared_map_open(&stat_cache, stat_cache_path());
 }
 
+// Does entry match st?
+static int same_stat(const struct stat_cache_entry *entry, const struct stat *st)
+{
+    return entry->st_mtimespec.tv_nsec == st->st_mtimespec.tv_nsec
+        && entry->st_mtimespec.tv_sec == st->st_mtimespec.tv_sec
+        && entry->st_size == st->st_size
+        && entry->st_ino == st->st_ino;
+}
+
+// Does entry match st, and does it have a hash if we need one?
+static int up_to_date(const struct stat_cache_entry *entry, const struct stat *st, int do_hash)
+{
+    return same_stat(entry, st) && !(do_hash && hash_is_all_one(&entry->contents_hash));
+}
+
+static void set_stat(struct stat_cache_entry *entry, const struct stat *st)
+{
+    entry->st_ino = st->st_ino;
+    entry->st_mtimespec = st->st_mtimespec;
+    entry->st_size = st->st_size;
+    entry->clean_epoch = 0;
+}
+
+/*
+ * Hashing a large file can take a long time, so we never hold the stat_cache
+ * lock while hashing.  Instead, the hashing process claims the entry by
+ * storing its pid in entry->hashing, drops the lock, hashes, and then relocks
+ * to publish the result.  Other processes wanting the same version of the
+ * file wait for that entry only; lookups of other files proceed as usual.  If
+ * the file changes in the meantime, the next process to notice takes over the
+ * entry and the stale result is discarded when it is published.
+ *
+ * Hashing a big file takes seconds, so waiters sleep with exponential backoff
+ * and watch the entry with lock free reads, taking the stripe lock only once
+ * it changes.  They check that the hasher is still alive every LIVENESS_NS of
+ * waiting, and take over the entry if it died.
+ */
+
+#define BACKOFF_MIN_NS 50000     // first sleep while waiting for a hasher
+#define BACKOFF_MAX_NS 20000000  // longest sleep (20 ms)
+#define LIVENESS_NS 100000000    // how often to check that the hasher lives
+
+// Is copy still being hashed by hasher for st?
+static int still_hashing(const struct stat_cache_entry *copy, const struct stat *st, pid_t hasher)
+{
+    return copy->hashing == hasher && same_stat(copy, st) && hash_is_all_one(&copy->contents_hash);
+}
+
+// Find the contents hash for st if it is known.  Otherwise, claim the entry
+// for hashing and return 0.  Waits while another live process is hashing the
+// same version of the file.
+static int claim(struct hash *hash, const struct stat *st, const struct hash *path_hash)
+{
+    pid_t pid = getpid();
+    long delay = 0, waited = LIVENESS_NS; // check liveness at once
+    for (;;) {
+        shared_map_lock(&stat_cache);
+        struct stat_cache_entry *entry;
+        int found = shared_map_lookup(&stat_cache, path_hash, (void**)&entry, 1);
+        if (found && up_to_date(entry, st, 1)) {
+            *hash = entry->contents_hash;
+            shared_map_unlock(&stat_cache);
+            return 1;
+        }
+        pid_t hasher = found && same_stat(entry, st) ? entry->hashing : 0;
+        int check = waited >= LIVENESS_NS;
+        if (!hasher || hasher == pid || (check && kill(hasher, 0) < 0 && errno == ESRCH)) {
+            set_stat(entry, st);
+            memset(&entry->contents_hash, -1, sizeof(struct hash));
+            entry->hashing = pid;
+            shared_map_unlock(&stat_cache);
+            return 0;
+        }
+        shared_map_unlock(&stat_cache);
+        if (check)
+            waited = 0;
+
+        // Sleep until the entry changes or it's time to check on the hasher
+        struct stat_cache_entry copy;
+        do {
+            delay = delay ? min(2 * delay, BACKOFF_MAX_NS) : BACKOFF_MIN_NS;
+            struct timespec ts = { 0, delay };
+            nanosleep(&ts, 0);
+            waited += delay;
+        } while (waited < LIVENESS_NS && shared_map_read(&stat_cache, path_hash, &copy)
+                 && still_hashing(&copy, st, hasher));
+    }
+}
+
+// Publish the hash computed after a successful claim, unless someone else has
+// taken over the entry since.
+static void publish(const struct hash *hash, const struct stat *st, const struct hash *path_hash)
+{
+    shared_map_lock(&stat_cache);
+    struct stat_cache_entry *entry;
+    if (shared_map_lookup(&stat_cache, path_hash, (void**)&entry, 0)
+        && entry->hashing == getpid() && same_stat(entry, st))
+    {
+        entry->contents_hash = *hash;
+        entry->hashing = 0;
+    }
+    shared_map_unlock(&stat_cache);
+}
+
+// If a watcher is running and has seen no change to the path since we last
+// verified it, we can skip lstat entirely.
+static int trusted(struct hash *hash, const struct hash *path_hash, int do_hash, uint32_t epoch)
+{
+    struct stat_cache_entry copy;
+    if (!shared_map_read(&stat_cache, path_hash, &copy) || copy.clean_epoch != epoch)
+        return 0;
+    if (hash_is_null(&copy.contents_hash))
+        memset(hash, 0, sizeof(struct hash));
+    else if (!do_hash)
+        memset(hash, -1, sizeof(struct hash));
+    else if (hash_is_all_one(&copy.contents_hash))
+        return 0;
+    else
+        *hash = copy.contents_hash;
+    return 1;
+}
+
+// Mark the entry for path_hash as verified in the given epoch if it still
+// matches st and the watcher hasn't applied any invalidations since seq.
+static void mark_clean(const char *path, const struct hash *path_hash, const struct stat *st, uint32_t epoch, uint32_t seq)
+{
+    // The watcher reports changes by canonical path, so other paths can't be
+    // trusted.  Only relative paths need the inverse map to find out.
+    char absolute[PATH_MAX];
+    if (path[0] != '/') {
+        int size;
+        inverse_hash_many(1, path_hash, absolute, sizeof(absolute), &size);
+        if (size < 0)
+            return;
+        path = absolute;
+    }
+    if (!watch_covers(path))
+        return;
+
+    shared_map_lock(&stat_cache);
+    struct stat_cache_entry *entry;
+    if (shared_map_lookup(&stat_cache, path_hash, (void**)&entry, 0)
+        && same_stat(entry, st) && watch_seq() == seq)
+        entry->clean_epoch = epoch;
+    shared_map_unlock(&stat_cache);
+}
+
+/*
+ * Compilers probe for each header in every include directory, so most lookups
+ * in a build are of files that don't exist.  We remember these as negative
+ * entries holding the stat information of the parent directory, whose mtime
+ * changes whenever a name is added to it.  Checking a negative entry costs a
+ * stat of the parent and no lstat failure; under a watcher it costs nothing,
+ * since creating the file invalidates the entry like any other change.
+ *
+ * A compiler probes the same include directory dozens of times in a row, so
+ * each process also remembers the parent stats it has taken for the rest of
+ * the current second, and all negative entries in a directory share one stat.
+ * This is a new window, separate from the mtime guard in remember_missing:
+ * for up to a second after a process stats a directory, a file created there
+ * by a process outside the traced tree can be reported missing to it.  To
+ * keep that to directories nobody is working in, parents modified in the
+ * last two seconds are never remembered, and files this process creates
+ * itself flush the parents it remembers (see stat_cache_forget_parents).
+ */
+
+#define PARENT_STATS 16 // parent directory stats remembered per process
+
+static struct parent_stat
+{
+    struct hash dir_hash;
+    time_t when; // second in which st was taken, or zero
+    struct stat st;
+} parent_stats[PARENT_STATS];
+
+void stat_cache_forget_parents()
+{
+    int i;
+    for (i = 0; i < PARENT_STATS; i++)
+        parent_stats[i].when = 0;
+}
+
+// stat the directory containing path.  Returns 0 if it isn't a directory.
+static int stat_parent(const char *path, struct stat *st)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash && !slash[1])
+        return 0; // trailing slash: leave these to lstat
+    const char *parent = ".";
+    char buffer[PATH_MAX];
+    int n = 1;
+    if (slash) {
+        n = max(slash - path, 1);
+        memcpy(buffer, path, n);
+        buffer[n] = 0;
+        parent = buffer;
+    }
+
+    struct hash dir_hash;
+    hash_memory(&dir_hash, parent, n);
+    struct parent_stat *p = parent_stats + dir_hash.data[0] % PARENT_STATS;
+    time_t now = time(0);
+    if (p->when == now && hash_equal(&p->dir_hash, &dir_hash)) {
+        *st = p->st;
+        return 1;
+    }
+    if (real_stat(parent, st) < 0 || !S_ISDIR(st->st_mode))
+        return 0;
+    if (st->st_mtimespec.tv_sec >= now - 1)
+        return 1;
+    p->dir_hash = dir_hash;
+    p->when = now;
+    p->st = *st;
+    return 1;
+}
+
+// Is path_hash known not to exist?  If so, fills in the parent's stat.
+static int known_missing(const char *path, const struct hash *path_hash, struct stat *parent)
+{
+    struct stat_cache_entry copy;
+    return shared_map_read(&stat_cache, path_hash, &copy) && hash_is_null(&copy.contents_hash)
+        && stat_parent(path, parent) && same_stat(&copy, parent);
+}
+
+// path was just found missing: record a negative entry.  Returns 1 and fills
+// in the parent's stat if an entry was recorded.
+static int remember_missing(const char *path, const struct hash *path_hash, struct stat *parent)
+{
+    // Stat the parent, then check that path is still missing, so that a file
+    // created in between bumps the parent's mtime after we read it.  Skip
+    // parents modified in the last second or two, since a file created now
+    // might not change an mtime with coarse granularity.
+    struct stat st;
+    if (!stat_parent(path, parent) || parent->st_mtimespec.tv_sec >= time(0) - 1
+        || real_lstat(path, &st) == 0)
+        return 0;
+
+    shared_map_lock(&stat_cache);
+    struct stat_cache_entry *entry;
+    shared_map_lookup(&stat_cache, path_hash, (void**)&entry, 1);
+    set_stat(entry, parent);
+    memset(&entry->contents_hash, 0, sizeof(struct hash));
+    entry->hashing = 0;
+    shared_map_unlock(&stat_cache);
+    return 1;
+}
+
+// Update the entry given fresh stat information
+static void update(struct hash *hash, const char *path, const struct stat *st, const struct hash *path_hash, int do_hash)
+{
+    // Most files are unchanged, so check without locking first
+    struct stat_cache_entry copy;
+    if (shared_map_read(&stat_cache, path_hash, &copy) && up_to_date(&copy, st, do_hash)) {
+        if (do_hash)
+            *hash = copy.contents_hash;
+        else
+            memset(hash, -1, sizeof(struct hash));
+        return;
+    }
+
+    if (!do_hash) {
+        // Record the new stat details, leaving the hash unknown
+        shared_map_lock(&stat_cache);
+        struct stat_cache_entry *entry;
+        shared_map_lookup(&stat_cache, path_hash, (void**)&entry, 1);
+        if (!same_stat(entry, st)) {
+            set_stat(entry, st);
+            memset(&entry->contents_hash, -1, sizeof(struct hash));
+            entry->hashing = 0;
+        }
+        shared_map_unlock(&stat_cache);
+        memset(hash, -1, sizeof(struct hash));
+        return;
+    }
+
+    if (claim(hash, st, path_hash))
+        return;
+
+    // Hash the file without holding the lock
+    int fd = real_open(path, O_RDONLY, 0);
+    if (fd < 0)
+        die("can't open '%s' to compute hash", path);
+    hash_fd(hash, fd);
+    real_close(fd);
+    publish(hash, st, path_hash);
+}
+
 void stat_cache_update(struct hash *hash, const char *path, const struct hash *path_hash, int do_hash)
 {
     initialize();
 
+    uint32_t epoch = watch_epoch(), seq = watch_seq();
+    if (epoch && trusted(hash, path_hash, do_hash, epoch))
+        return;
+
+    struct stat parent;
+    if (known_missing(path, path_hash, &parent)) {
+        memset(hash, 0, sizeof(struct hash));
+        if (epoch)
+            mark_clean(path, path_hash, &parent, epoch, seq);
+        return;
+    }
+
     // lstat the file
     struct stat st;
     if (real_lstat(path, &st) < 0) {
@@ -59,6 +363,8 @@ void stat_cache_update(struct hash *hash, const char *path, const struct hash *p
         if (errno_ == ENOENT || errno_ == ENOTDIR) {
             // Set hash to zero to represent nonexistent file
             memset(hash, 0, sizeof(struct hash));
+            if (remember_missing(path, path_hash, &parent) && epoch)
+                mark_clean(path, path_hash, &parent, epoch, seq);
             return;
         }
         die("lstat(\"%s\") failed: %s", path, strerror(errno_));
@@ -67,43 +373,9 @@ void stat_cache_update(struct hash *hash, const char *path, const struct hash *p
     // TODO: We currently ignore the S_ISLNK flag, which assumes that traced
     // processes never detect symlinks via lstat and never create them.
 
-    // For now we go the simple route and hold the stat_cache lock for the
-    // entire duration of the hash computation.  In future we may want to drop
-    // the lock while we compute the hash.  Alternatively, switching to a finer
-    // grain locking discipline might avoid the problem.
-    shared_map_lock(&stat_cache);
-
-    // Lookup entry, creating it if necessary, and check if it's up to date
-    struct stat_cache_entry *entry;
-    if (!shared_map_lookup(&stat_cache, path_hash, (void**)&entry, 1)
-        || entry->st_mtimespec.tv_nsec != st.st_mtimespec.tv_nsec
-        || entry->st_mtimespec.tv_sec != st.st_mtimespec.tv_sec
-        || entry->st_size != st.st_size
-        || entry->st_ino != st.st_ino
-        || (do_hash && hash_is_all_one(&entry->contents_hash)))
-    {
-        // Entry is new or out of date.  In either case, compute hash and
-        // record new stat details.
-        entry->st_ino = st.st_ino;
-        entry->st_mtimespec = st.st_mtimespec;
-        entry->st_size = st.st_size;
-
-        if (do_hash) {
-            // Hash the file
-            int fd = real_open(path, O_RDONLY, 0);
-            if (fd < 0)
-                die("can't open '%s' to compute hash", path);
-            hash_fd(&entry->contents_hash, fd);
-            real_close(fd);
-        }
-        else
-            memset(&entry->contents_hash, -1, sizeof(struct hash));
-    }
-    shared_map_unlock(&stat_cache);
-    if (do_hash)
-        *hash = entry->contents_hash;
-    else
-        memset(hash, -1, sizeof(struct hash));
+    update(hash, path, &st, path_hash, do_hash);
+    if (epoch)
+        mark_clean(path, path_hash, &st, epoch, seq);
 }
 
 void stat_cache_update_fd(struct hash *hash, int fd, const struct hash *path_hash)
@@ -115,32 +387,81 @@ void stat_cache_update_fd(struct hash *hash, int fd, const struct hash *path_has
     if (real_fstat(fd, &st) < 0)
         die("fstat(%d) failed: %s", fd, strerror(errno));
 
-    // For now we go the simple route and hold the stat_cache lock for the
-    // entire duration of the hash computation.  In future we may want to drop
-    // the lock while we compute the hash.  Alternatively, switching to a finer
-    // grain locking discipline might avoid the problem.
+    struct stat_cache_entry copy;
+    if (shared_map_read(&stat_cache, path_hash, &copy) && up_to_date(&copy, &st, 1)) {
+        *hash = copy.contents_hash;
+        return;
+    }
+
+    if (claim(hash, &st, path_hash))
+        return;
+
+    // Hash the file without holding the lock
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        die("lseek failed: %s", strerror(errno));
+    hash_fd(hash, fd);
+    publish(hash, &st, path_hash);
+}
+
+void stat_cache_record(const struct hash *hash, int fd, const struct hash *path_hash)
+{
+    initialize();
+    stat_cache_forget_parents();
+
+    struct stat st;
+    if (real_fstat(fd, &st) < 0)
+        die("fstat(%d) failed: %s", fd, strerror(errno));
+    stat_cache_record_stat(hash, &st, path_hash);
+}
+
+void stat_cache_record_stat(const struct hash *hash, const struct stat *st, const struct hash *path_hash)
+{
+    initialize();
+
     shared_map_lock(&stat_cache);
+    struct stat_cache_entry *entry;
+    shared_map_lookup(&stat_cache, path_hash, (void**)&entry, 1);
+    set_stat(entry, st);
+    entry->contents_hash = *hash;
+    entry->hashing = 0;
+    shared_map_unlock(&stat_cache);
+}
 
-    // Lookup entry, creating it if necessary, and check if it's up to date
+void stat_cache_invalidate(const struct hash *path_hash)
+{
+    initialize();
+
+    shared_map_lock(&stat_cache);
     struct stat_cache_entry *entry;
-    if (!shared_map_lookup(&stat_cache, path_hash, (void**)&entry, 1)
-        || entry->st_mtimespec.tv_nsec != st.st_mtimespec.tv_nsec
-        || entry->st_mtimespec.tv_sec != st.st_mtimespec.tv_sec
-        || entry->st_size != st.st_size
-        || entry->st_ino != st.st_ino
-        || hash_is_all_one(&entry->contents_hash))
-    {
-        // Entry is new or out of date.  In either case, compute hash and
-        // record new stat details.
-        entry->st_ino = st.st_ino;
-        entry->st_mtimespec = st.st_mtimespec;
-        entry->st_size = st.st_size;
-
-        // Hash the file
-        if (lseek(fd, 0, SEEK_SET) < 0)
-            die("lseek failed: %s", strerror(errno));
-        hash_fd(&entry->contents_hash, fd);
-    }
+    if (shared_map_lookup(&stat_cache, path_hash, (void**)&entry, 0))
+        entry->clean_epoch = 0;
     shared_map_unlock(&stat_cache);
-    *hash = entry->contents_hash;
+}
+
+int stat_cache_fresh(const struct hash *path_hash, const struct stat *st)
+{
+    initialize();
+
+    struct stat_cache_entry entry;
+    return shared_map_read(&stat_cache, path_hash, &entry) && up_to_date(&entry, st, 1);
+}
+
+static int (*compact_keep)(const struct hash *path_hash);
+
+static int compact_helper(const struct hash *path_hash, const void *value)
+{
+    return compact_keep(path_hash);
+}
+
+int stat_cache_compact(int (*keep)(const struct hash *path_hash))
+{
+    initialize();
+    compact_keep = keep;
+    return shared_map_compact(&stat_cache, compact_helper);
+}
+
+uint64_t stat_cache_entry_bytes()
+{
+    initialize();
+    return shared_map_entry_bytes(&stat_cache);
 }
@@ -4,11 +4,13 @@
 #define __stat_cache_h__
 
 #include "hash.h"
+#include "arch.h"
 
 /*
  * The stat cache is a map from hash(filename) to hash(contents) the last time
  * we checked, plus lstat information in order to check whether the file might
- * have changed.
+ * have changed.  Files found not to exist are remembered too, keyed on the
+ * stat information of their parent directory.
  */
 
 // Initialize the stat_cache if it does not already exist.
@@ -21,4 +23,29 @@ extern void stat_cache_update(struct hash *hash, const char *path, const struct
 // Update the entry for a file based on an open file descriptor.
 extern void stat_cache_update_fd(struct hash *hash, int fd, const struct hash *path_hash);
 
+// Record a known contents hash for a file based on an open file descriptor,
+// e.g., for a file just restored from the content store.
+extern void stat_cache_record(const struct hash *hash, int fd, const struct hash *path_hash);
+
+// Same as stat_cache_record given the stat information directly.
+extern void stat_cache_record_stat(const struct hash *hash, const struct stat *st, const struct hash *path_hash);
+
+// Forget that the entry for path_hash was verified clean (see watch.h).
+extern void stat_cache_invalidate(const struct hash *path_hash);
+
+// Stop trusting the parent directory stats this process has remembered for
+// checking nonexistent files, since it is about to create a file.
+extern void stat_cache_forget_parents();
+
+// Check whether the entry for path_hash matches st and has a contents hash.
+extern int stat_cache_fresh(const struct hash *path_hash, const struct stat *st);
+
+// Rewrite the stat cache keeping only the entries for which keep returns true.
+// Returns the number kept.  Must not run concurrently with other waitless
+// processes.
+extern int stat_cache_compact(int (*keep)(const struct hash *path_hash));
+
+// Bytes the stat cache file spends on each entry, on average (see gc.c).
+extern uint64_t stat_cache_entry_bytes();
+
 #endif
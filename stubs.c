@@ -7,6 +7,7 @@
 #include "real_call.h"
 #include "inverse_map.h"
 #include "search_path.h"
+#include "process.h"
 
 /*
  * READ THIS FIRST:
@@ -104,7 +105,7 @@
  *
  *        open, creat, close
  *        stat, lstat, access
- *        chdir, rename, truncate
+ *        chdir, fchdir, rename, truncate
  *
  *    plus their libc equivalents:
  *
@@ -550,12 +551,17 @@ int chdir(const char *path)
     if (ret < 0)
         die("chdirs(\"%s\") failed: %s", path, strerror(errno)); 
 
+    forget_cwd();
     return ret;
 }
 
 int fchdir(int fd)
 {
-    NOT_IMPLEMENTED("fchdir");
+    // The directory was already recorded when fd was opened
+    int ret = real_fchdir(fd);
+    if (ret == 0)
+        forget_cwd();
+    return ret;
 }
 
 int rename(const char *old, const char *new)
@@ -642,10 +648,9 @@ int execvP(const char *file, const char *PATH, const char *const argv[])
 {
     // Normally execvP works by repeatedly calling execve for each component
     // of the search path.  However, we'd prefer to call action_execve only
-    // once, so we use a bunch of stat calls instead (at the cost of one extra
-    // system call total).
+    // once, so we search PATH ourselves instead.
     char buffer[PATH_MAX];
-    file = search_path(buffer, file, PATH);
+    file = action_search_path(buffer, file, PATH);
     if (!file)
         return -1;
 
@@ -655,7 +660,7 @@ int execvP(const char *file, const char *PATH, const char *const argv[])
 int execvp(const char *file, char *const argv[])
 {
     // Note: Passing null for PATH is correct only because we're calling our
-    // special version of execvP (which calls our version of search_path).
+    // special version of execvP (which calls action_search_path).
     return execvP(file, 0, (const char *const *)argv);
 }
 
@@ -688,7 +693,10 @@ pid_t waitpid(pid_t pid, int *status, int options)
             return ret;
         die("waitpid failed: %s", strerror(errno));
     }
-    else if (status) {
+    else if (ret)
+        reap_process_info(ret);
+
+    if (ret && status) {
         // !(options & WUNTRACED), so process either exited or caught a signal
         if (WIFSIGNALED(*status)) {
             int signal = WTERMSIG(*status);
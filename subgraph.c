@@ -6,21 +6,23 @@
 #include "env.h"
 #include "util.h"
 #include "inverse_map.h"
+#include <errno.h>
 
 struct subgraph_entry {
     enum action_type type;
     struct hash data; // meaning depends on type
+    uint32_t used; // last time the node was created or replayed (see gc.c)
 };
 
-// TODO: Rethink default counts and make them resizable
-static struct shared_map subgraph = { "subgraph", sizeof(struct subgraph_entry), 1<<15 };
+// Nodes record their last use at this granularity, so that hot nodes aren't
+// written on every use
+#define USED_GRANULARITY 3600
+
+static struct shared_map subgraph = { "subgraph", sizeof(struct subgraph_entry), 1<<15, 1 };
 
 static const char *subgraph_path()
 {
-    const char *waitless_dir = getenv(WAITLESS_DIR);
-    if (!waitless_dir)
-        die("WAITLESS_DIR not set");
-    return path_join(waitless_dir, subgraph.name);
+    return waitless_path(subgraph.name);
 }
 
 void subgraph_init()
@@ -39,21 +41,24 @@ void initialize()
     shared_map_open(&subgraph, subgraph_path());
 }
 
-char *show_subgraph_node(char s[SHOW_NODE_SIZE], enum action_type type, const struct hash *data)
+// Does data have a preimage in the inverse map?
+static int has_preimage(enum action_type type)
+{
+    return type == SG_STAT || type == SG_READ || type == SG_WRITE || type == SG_EXEC || type == SG_SEARCH;
+}
+
+// show_subgraph_node given buffer = the preimage of data (if any)
+static char *show_node(char s[SHOW_NODE_SIZE], enum action_type type, const struct hash *data, char buffer[SHOW_NODE_SIZE])
 {
     int n;
-    char buffer[SHOW_NODE_SIZE];
     switch (type) {
         case SG_STAT:
-            inverse_hash_string(data, buffer, sizeof(buffer));
             n = snprintf(s, SHOW_NODE_SIZE, "stat(\"%s\")", buffer);
             break;
         case SG_READ:
-            inverse_hash_string(data, buffer, sizeof(buffer));
             n = snprintf(s, SHOW_NODE_SIZE, "read(\"%s\")", buffer);
             break;
         case SG_WRITE: {
-            inverse_hash_memory(data, buffer, sizeof(buffer));
             struct hash *hashes = (struct hash*)buffer;
             char *p = s;
             p += strlcpy(p, "write(\"", s+SHOW_NODE_SIZE-p);
@@ -68,8 +73,7 @@ char *show_subgraph_node(char s[SHOW_NODE_SIZE], enum action_type type, const st
             n = snprintf(s, SHOW_NODE_SIZE, "fork(%d)", data->data[0] ? 1 : 0);
             break;
         case SG_EXEC: {
-            // See action_execve in action.c for data format
-            inverse_hash_string(data, buffer, sizeof(buffer));
+            // See subgraph_exec_data for data format
             char *p = s, *q = buffer;
             p += strlcpy(p, "exec(\"", s+SHOW_NODE_SIZE-p);
             // Copy path
@@ -95,42 +99,223 @@ char *show_subgraph_node(char s[SHOW_NODE_SIZE], enum action_type type, const st
         case SG_EXIT:
             n = snprintf(s, SHOW_NODE_SIZE, "exit(%d)", data->data[0]);
             break;
+        case SG_SEARCH:
+            // The search record starts with the file name (see search_path.h)
+            n = snprintf(s, SHOW_NODE_SIZE, "search(\"%s\")", buffer);
+            break;
         default:
             n = snprintf(s, SHOW_NODE_SIZE, "unknown type %d", type);
     }
     return s + min(n, SHOW_NODE_SIZE - 1);
 }
 
+// The current time, computed once per process
+static uint32_t now()
+{
+    static uint32_t t;
+    if (!t)
+        t = time(0);
+    return t;
+}
+
+// Record that a node is in use
+static void touch(const struct hash *name, const struct subgraph_entry *entry)
+{
+    if (entry->used + USED_GRANULARITY < now())
+        shared_map_touch(&subgraph, name, offsetof(struct subgraph_entry, used), now());
+}
+
+char *show_subgraph_node(char s[SHOW_NODE_SIZE], enum action_type type, const struct hash *data)
+{
+    char buffer[SHOW_NODE_SIZE];
+    if (has_preimage(type))
+        inverse_hash_string(data, buffer, sizeof(buffer));
+    return show_node(s, type, data, buffer);
+}
+
 void subgraph_new_node(const struct hash *name, enum action_type type, const struct hash *data)
 {
     initialize();
 
-    shared_map_lock(&subgraph);  
-    struct subgraph_entry *entry;
-    if (!shared_map_lookup(&subgraph, name, (void**)&entry, 1)) {
-        // New entry
-        entry->type = type;
-        entry->data = *data;
-    }
-    else {
-        if (entry->type != type || !hash_equal(&entry->data, data)) {
+    struct subgraph_entry entry, old_entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.type = type;
+    entry.data = *data;
+    entry.used = now();
+    if (shared_map_insert(&subgraph, name, &entry, &old_entry)) {
+        if (old_entry.type != type || !hash_equal(&old_entry.data, data)) {
             char hash[SHOW_HASH_SIZE], old[SHOW_NODE_SIZE], new[SHOW_NODE_SIZE];
             show_hash(hash, 8, name);
-            show_subgraph_node(old, entry->type, &entry->data);
+            show_subgraph_node(old, old_entry.type, &old_entry.data);
             show_subgraph_node(new, type, data);
             die("nondeterminism detected at node %s:\n  old: %s\n  new: %s", hash, old, new);
         }
+        touch(name, &old_entry);
     }
+}
+
+int subgraph_lookup(const struct hash *name, enum action_type *type, struct hash *data)
+{
+    initialize();
+
+    struct subgraph_entry entry;
+    if (!shared_map_read(&subgraph, name, &entry))
+        return 0;
+    touch(name, &entry);
+    *type = entry.type;
+    *data = entry.data;
+    return 1;
+}
+
+static subgraph_visitor visitor;
+
+static int visit_helper(const struct hash *name, const void *value)
+{
+    const struct subgraph_entry *entry = value;
+    return visitor(name, entry->type, &entry->data, entry->used);
+}
+
+static int iter_helper(const struct hash *name, void *value)
+{
+    return visit_helper(name, value);
+}
+
+int subgraph_iter(subgraph_visitor f)
+{
+    initialize();
+    visitor = f;
+    shared_map_lock(&subgraph);
+    int r = shared_map_iter(&subgraph, iter_helper);
     shared_map_unlock(&subgraph);
+    return r;
+}
+
+int subgraph_compact(subgraph_visitor keep)
+{
+    initialize();
+    visitor = keep;
+    return shared_map_compact(&subgraph, visit_helper);
+}
+
+uint64_t subgraph_node_bytes()
+{
+    initialize();
+    return shared_map_entry_bytes(&subgraph);
+}
+
+void subgraph_exec_data(struct hash *hash, const char *path, const char *const argv[], const char *const envp[], int linked)
+{
+    // Pack all the arguments into a single buffer.  The format is
+    //     char path[];
+    //     uint32_t argc;
+    //     char argv[argc][];
+    //     char is_pipe;
+    //     uint32_t envc;
+    //     char envp[envc][];
+    //     char cwd[];
+    // with all strings packed together with terminating nulls.
+    char data[EXEC_DATA_SIZE];
+    char *p = data;
+#define ADD_STR(s) p += strlcpy(p, (s), data+sizeof(data)-p) + 1
+    ADD_STR(path);
+    // encode argv
+    char *cp = p;
+    p += sizeof(uint32_t); // skip 4 bytes for len(argv)
+    uint32_t i;
+    for (i = 0; argv[i]; i++)
+        ADD_STR(argv[i]);
+    memcpy(cp, &i, sizeof(uint32_t));
+    *p++ = linked;
+    // encode envp
+    cp = p;
+    p += sizeof(uint32_t); // skip 4 bytes for len(envp)
+    uint32_t count = 0;
+    for (i = 0; envp[i]; i++)
+        if (!startswith(envp[i], "WAITLESS")) {
+            ADD_STR(envp[i]);
+            count++;
+        }
+    memcpy(cp, &count, sizeof(uint32_t));
+    // encode pwd
+    if (!real_getcwd(p, data+sizeof(data)-p))
+        die("subgraph_exec_data: getcwd failed: %s", strerror(errno));
+    int n = p - data + strlen(p) + 1;
+#undef ADD_STR
+
+    remember_hash_memory(hash, data, n);
+}
+
+void subgraph_exec_info(struct exec_info *info, char buffer[EXEC_DATA_SIZE], const struct hash *data)
+{
+    // See subgraph_exec_data for the format
+    int n = inverse_hash_memory(data, buffer, EXEC_DATA_SIZE);
+    const char *q = buffer, *end = buffer + n;
+    uint32_t count, i;
+
+    info->path = q;
+    q += strlen(q) + 1;
+    // skip argv
+    memcpy(&count, q, sizeof(uint32_t));
+    q += sizeof(uint32_t);
+    for (i = 0; i < count; i++)
+        q += strlen(q) + 1;
+    info->linked = *q++;
+    // skip envp
+    memcpy(&count, q, sizeof(uint32_t));
+    q += sizeof(uint32_t);
+    for (i = 0; i < count; i++)
+        q += strlen(q) + 1;
+    info->cwd = q;
+    if (q >= end)
+        die("subgraph_exec_info: corrupt exec record");
+}
+
+// subgraph_dump prints nodes in batches, so that the inverse map lookups for
+// their data can overlap
+#define DUMP_BATCH 32
+
+static struct dump_batch
+{
+    int n;
+    struct hash names[DUMP_BATCH];
+    struct subgraph_entry entries[DUMP_BATCH];
+} dump_batch;
+
+static void dump_flush()
+{
+    struct dump_batch *b = &dump_batch;
+    struct hash data[DUMP_BATCH];
+    char buffers[DUMP_BATCH][SHOW_NODE_SIZE];
+    int sizes[DUMP_BATCH], i, m = 0;
+    for (i = 0; i < b->n; i++)
+        if (has_preimage(b->entries[i].type))
+            data[m++] = b->entries[i].data;
+    inverse_hash_many(m, data, buffers[0], SHOW_NODE_SIZE, sizes);
+
+    for (i = m = 0; i < b->n; i++) {
+        const struct subgraph_entry *entry = b->entries + i;
+        char hash[SHOW_HASH_SIZE], node[SHOW_NODE_SIZE];
+        show_hash(hash, 8, b->names + i);
+        if (!has_preimage(entry->type))
+            show_node(node, entry->type, &entry->data, 0);
+        else if (sizes[m] < 0) {
+            m++;
+            strlcpy(node, "<missing from inverse map>", sizeof(node));
+        }
+        else
+            show_node(node, entry->type, &entry->data, buffers[m++]);
+        fdprintf(STDOUT_FILENO, "  %s: %s\n", hash, node);
+    }
+    b->n = 0;
 }
 
 static int dump_helper(const struct hash *name, void *value)
 {
-    struct subgraph_entry *entry = value;
-    char hash[SHOW_HASH_SIZE], node[SHOW_NODE_SIZE];
-    show_hash(hash, 8, name);
-    show_subgraph_node(node, entry->type, &entry->data);
-    fdprintf(STDOUT_FILENO, "  %s: %s\n", hash, node);
+    struct dump_batch *b = &dump_batch;
+    b->names[b->n] = *name;
+    b->entries[b->n] = *(struct subgraph_entry*)value;
+    if (++b->n == DUMP_BATCH)
+        dump_flush();
     return 0;
 }
 
@@ -140,6 +325,8 @@ void subgraph_dump()
 
     shared_map_lock(&subgraph);
     write_str(STDOUT_FILENO, "subgraph dump:\n");
+    dump_batch.n = 0;
     shared_map_iter(&subgraph, dump_helper);
+    dump_flush();
     shared_map_unlock(&subgraph);
 }
@@ -44,6 +44,7 @@
  *        exec(path, argv, envp) - become a new process
  *        exec(path) - become a new process with a link to the parent, so that
               subgraph nodes are interleaved as with fork(0)
+ *        search(file, PATH) - find an executable in PATH
  *        wait(...) - TODO: figure out waits (yes, sometimes we want these)
  *            These are complicated because of the slew of different wait calls.
  *        exit(status) - exit with the given status
@@ -174,6 +175,7 @@ enum action_type {
     SG_EXEC  = 5,
     SG_WAIT  = 6,
     SG_EXIT  = 7,
+    SG_SEARCH = 8,
 };
 
 // Create the subgraph on disk necessary
@@ -187,6 +189,47 @@ static inline void subgraph_node_name(struct hash *name, const struct hash *pare
 
 extern void subgraph_new_node(const struct hash *name, enum action_type type, const struct hash *data);
 
+// Look up an existing process node.  Returns false if the node is not in the
+// subgraph, in which case type and data are left untouched.
+extern int subgraph_lookup(const struct hash *name, enum action_type *type, struct hash *data);
+
+// A function called on each node by subgraph_iter and subgraph_compact.  used
+// is the last time (in seconds since the epoch, at hourly granularity) the node
+// was created or looked up.
+typedef int (*subgraph_visitor)(const struct hash *name, enum action_type type, const struct hash *data, uint32_t used);
+
+// Call f on every node, stopping if f returns nonzero (and returning that
+// value if so).
+extern int subgraph_iter(subgraph_visitor f);
+
+// Rewrite the subgraph keeping only the nodes for which keep returns true.
+// Returns the number of nodes kept.  Must not run concurrently with other
+// waitless processes.
+extern int subgraph_compact(subgraph_visitor keep);
+
+// Bytes the subgraph file spends on each node, on average (see gc.c).
+extern uint64_t subgraph_node_bytes();
+
+// Exec nodes store the hash of a packed record of the arguments to execve.
+// The record is at most EXEC_DATA_SIZE bytes; see subgraph_exec_data for the
+// format.
+#define EXEC_DATA_SIZE 4096
+
+// Pack the arguments to execve into an exec record and remember its hash.
+extern void subgraph_exec_data(struct hash *hash, const char *path, const char *const argv[], const char *const envp[], int linked);
+
+// The fields of an exec record needed to replay it.  The pointers refer into
+// the buffer passed to subgraph_exec_info.
+struct exec_info
+{
+    const char *path;
+    int linked;
+    const char *cwd;
+};
+
+// Recover the fields of the exec record with the given hash.
+extern void subgraph_exec_info(struct exec_info *info, char buffer[EXEC_DATA_SIZE], const struct hash *data);
+
 extern void subgraph_dump();
 
 #define SHOW_NODE_SIZE 1024
@@ -0,0 +1,133 @@
+// Kill processes in the middle of growing or inserting into a shared map, and
+// check that every entry they inserted survives and that later processes don't
+// hang.
+
+#include "shared_map.h"
+#include "real_call.h"
+#include "util.h"
+#include <errno.h>
+
+extern unsigned alarm(unsigned seconds);
+
+#define ROUNDS 60
+#define VERIFY_SECONDS 20
+#define VERIFY_INSERTS 1000
+
+static char path[PATH_MAX], new_path[PATH_MAX + 4];
+static volatile uint32_t *acked;
+
+static void key_of(struct hash *key, uint32_t i)
+{
+    hash_memory(key, &i, sizeof(i));
+}
+
+static void insert(struct shared_map *map, uint32_t i)
+{
+    struct hash key;
+    key_of(&key, i);
+    if (map->immutable)
+        shared_map_insert(map, &key, &i, 0);
+    else {
+        uint32_t *value;
+        shared_map_lock(map);
+        shared_map_lookup(map, &key, (void**)&value, 1);
+        *value = i;
+        shared_map_unlock(map);
+    }
+}
+
+// Insert keys from first on, counting each one in *acked once it is in
+static void inserter(struct shared_map *map, uint32_t first)
+{
+    shared_map_open(map, path);
+    uint32_t i;
+    for (i = first;; i++) {
+        insert(map, i);
+        *acked = i + 1;
+    }
+}
+
+// Check that keys [0,n) are all present, and that the map can still grow
+static void verifier(struct shared_map *map, uint32_t n)
+{
+    alarm(VERIFY_SECONDS);
+    shared_map_open(map, path);
+    uint32_t i, value;
+    for (i = 0; i < n; i++) {
+        struct hash key;
+        key_of(&key, i);
+        if (!shared_map_read(map, &key, &value) || value != i)
+            die("lost key %d of %d", i, n);
+    }
+    for (i = n; i < 2 * n + VERIFY_INSERTS; i++)
+        insert(map, i);
+    real__exit(0);
+}
+
+static int exists(const char *p)
+{
+    return real_access(p, 0) == 0;
+}
+
+static void test(struct shared_map *map)
+{
+    int round, mid_grow = 0;
+    for (round = 0; round < ROUNDS; round++) {
+        unlink(path);
+        unlink(new_path);
+        shared_map_init(map, real_open(path, O_CREAT | O_WRONLY, 0644));
+        *acked = 0;
+        pid_t pid = real_fork();
+        if (!pid)
+            inserter(map, 0);
+
+        // Let the map grow to a different size each round, then kill the
+        // inserter while it builds the grown map, just after the new map is
+        // renamed into place, or wherever it happens to be (most likely in
+        // the middle of an insert).
+        uint32_t size = 64 << round % 10;
+        int seen = 0;
+        while (*acked < size)
+            ;
+        while (round % 3 != 2) {
+            if (exists(new_path)) {
+                seen = 1;
+                if (round % 3 == 0)
+                    break;
+            }
+            else if (seen)
+                break;
+        }
+        mid_grow += exists(new_path);
+        kill(pid, SIGKILL);
+        int status;
+        real_waitpid(pid, &status, 0);
+
+        pid = real_fork();
+        if (!pid)
+            verifier(map, *acked);
+        if (real_waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+            die("%s map: verification failed after round %d (status 0x%x)",
+                map->immutable ? "immutable" : "mutable", round, status);
+    }
+    fdprintf(STDOUT_FILENO, "%s map: %d of %d kills mid-grow\n",
+        map->immutable ? "immutable" : "mutable", mid_grow, ROUNDS);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = argc > 1 ? argv[1] : ".";
+    snprintf(path, sizeof(path), "%s/grow.map", dir);
+    snprintf(new_path, sizeof(new_path), "%s.new", path);
+    acked = mmap(NULL, sizeof(*acked), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (acked == MAP_FAILED)
+        die("mmap failed: %s", strerror(errno));
+
+    struct shared_map immutable = { "grow", sizeof(uint32_t), 64, 1 };
+    struct shared_map mutable = { "grow", sizeof(uint32_t), 64, 0 };
+    test(&immutable);
+    test(&mutable);
+    unlink(path);
+    unlink(new_path);
+    return 0;
+}
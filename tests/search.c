@@ -0,0 +1,130 @@
+// Check that a memoized PATH search reports the same candidates as a fresh
+// one without statting the candidates that don't exist, and that adding a
+// candidate invalidates the memo.  search_path.c is compiled for this test
+// with real_stat renamed to counted_stat (see dmk).
+
+#include "search_path.h"
+#include "real_call.h"
+#include "env.h"
+#include "util.h"
+#include <sys/time.h>
+#include <errno.h>
+
+extern int system(const char *command);
+
+#define DIRS 8
+
+static char root[PATH_MAX / 2];
+static int stats, candidate_stats;
+
+int counted_stat(const char *path, struct stat *buf)
+{
+    stats++;
+    candidate_stats += endswith(path, "/tool");
+    return real_stat(path, buf);
+}
+
+// What probed saw: one character per candidate, '1' if it existed
+static char probes[DIRS + 1];
+static int probe_count;
+
+static void probed(const char *path, int exists)
+{
+    char expected[PATH_MAX];
+    snprintf(expected, sizeof(expected), "%s/p%d/tool", root, probe_count);
+    if (strcmp(path, expected))
+        die("probed %s, expected %s", path, expected);
+    probes[probe_count++] = exists ? '1' : '0';
+    probes[probe_count] = 0;
+}
+
+static const char *search(const char *PATH)
+{
+    static char buffer[PATH_MAX];
+    stats = candidate_stats = probe_count = 0;
+    return search_path(buffer, "tool", PATH, 0, probed);
+}
+
+static void make_tool(int i, mode_t mode)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/p%d/tool", root, i);
+    int fd = real_open(path, O_CREAT | O_WRONLY, mode);
+    if (fd < 0)
+        die("can't create %s: %s", path, strerror(errno));
+    real_close(fd);
+}
+
+// Searches through directories modified in the last second or two aren't
+// memoized, so pretend everything was made long ago
+static void age(const char *path)
+{
+    struct timeval times[2] = { { 1000000000, 0 }, { 1000000000, 0 } };
+    if (utimes(path, times) < 0)
+        die("utimes %s failed: %s", path, strerror(errno));
+}
+
+int main(int argc, char **argv)
+{
+    // Relative PATH entries would be resolved against cwd, so be absolute
+    char cwd[PATH_MAX];
+    if (!real_getcwd(cwd, sizeof(cwd)))
+        die("getcwd failed: %s", strerror(errno));
+    const char *dir = argc > 1 ? argv[1] : ".";
+    snprintf(root, sizeof(root), "%s/search.d", dir[0] == '/' ? dir : path_join(cwd, dir));
+    char command[PATH_MAX + 32];
+    snprintf(command, sizeof(command), "/bin/rm -rf %s", root);
+    system(command);
+    if (mkdir(root, 0755) < 0)
+        die("can't make %s: %s", root, strerror(errno));
+    env_set(WAITLESS_DIR, root);
+    search_path_init();
+
+    // tool exists in p3 (not executable) and p6
+    char PATH[DIRS * PATH_MAX / 2], path[PATH_MAX];
+    int i, n = 0;
+    for (i = 0; i < DIRS; i++) {
+        snprintf(path, sizeof(path), "%s/p%d", root, i);
+        if (mkdir(path, 0755) < 0)
+            die("can't make %s: %s", path, strerror(errno));
+        n += snprintf(PATH + n, sizeof(PATH) - n, "%s%s", i ? ":" : "", path);
+    }
+    make_tool(3, 0644);
+    make_tool(6, 0755);
+    for (i = 0; i < DIRS; i++) {
+        snprintf(path, sizeof(path), "%s/p%d/tool", root, i);
+        if (i == 3 || i == 6)
+            age(path);
+        path[strlen(path) - 5] = 0;
+        age(path);
+    }
+
+    // A fresh search stats every directory and candidate up to p6
+    const char *found = search(PATH);
+    snprintf(path, sizeof(path), "%s/p6/tool", root);
+    if (!found || strcmp(found, path))
+        die("fresh search found %s, expected %s", found ? found : "nothing", path);
+    if (strcmp(probes, "0001001") || candidate_stats != 7)
+        die("fresh search: probed %s, statted %d candidates", probes, candidate_stats);
+
+    // A memo hit stats the directories and the two candidates that exist,
+    // and reports the rest from the memo
+    found = search(PATH);
+    if (!found || strcmp(found, path))
+        die("memoized search found %s, expected %s", found ? found : "nothing", path);
+    if (strcmp(probes, "0001001") || candidate_stats != 2 || stats != 9)
+        die("memoized search: probed %s, statted %d paths and %d candidates", probes, stats, candidate_stats);
+
+    // A new candidate changes its directory, so the memo no longer holds
+    make_tool(1, 0755);
+    found = search(PATH);
+    snprintf(path, sizeof(path), "%s/p1/tool", root);
+    if (!found || strcmp(found, path))
+        die("search after adding p1/tool found %s", found ? found : "nothing");
+    if (strcmp(probes, "01"))
+        die("search after adding p1/tool: probed %s", probes);
+
+    fdprintf(STDOUT_FILENO, "search: memo hit statted only the candidates that exist\n");
+    system(command);
+    return 0;
+}
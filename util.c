@@ -12,7 +12,7 @@ void fdprintf(int fd, const char *format, ...)
     va_start(ap, format);
     char buffer[1024];
     int n = vsnprintf(buffer, sizeof(buffer), format, ap);
-    write(STDERR_FILENO, buffer, min(n, sizeof(buffer)-1));
+    write(fd, buffer, min(n, sizeof(buffer)-1));
     va_end(ap);
 }
 
@@ -55,7 +55,7 @@ static inline unsigned least_set_bit(unsigned x)
 #define rotate(x, n) ({ \
     typeof(x) _x = (x); \
     int _n = (n); \
-    ((_x << _n) | (_x >> (sizeof(typeof(x))/8 - _n))); \
+    ((_x << _n) | (_x >> (8*sizeof(typeof(x)) - _n))); \
     })
 
 static inline int startswith(const char *s, const char *prefix)
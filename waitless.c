@@ -10,11 +10,23 @@
 #include "search_path.h"
 #include "action.h"
 #include "process.h"
+#include "replay.h"
+#include "inverse_map.h"
+#include "gc.h"
+#include "prime.h"
+#include "watch.h"
 #include <getopt.h>
 #include <errno.h>
 
-// Use an explicit forward declaration to avoid bringing in all of stdlib.h
+// Use explicit forward declarations to avoid bringing in all of stdlib.h
 extern int system(const char *command);
+extern int atoi(const char *s);
+extern long sysconf(int name);
+#ifdef __APPLE__
+#define _SC_NPROCESSORS_ONLN 58
+#else
+#define _SC_NPROCESSORS_ONLN 84
+#endif
 
 #ifdef __APPLE__
 #define PRELOAD_NAME "DYLD_INSERT_LIBRARIES"
@@ -30,10 +42,20 @@ static void usage()
         "usage: waitless [options] cmd [args...]\n"
         "       waitless [options]\n"
         "Run a command with automatic dependency analysis and caching.\n"
-        "If cmd is omitted, options must include -c or -h.\n"
+        "If cmd is omitted, options must include -c, -d, -g, -p, -w, or -h.\n"
         "\n"
         "Options:\n"
         "   -c, --clean          forget all stored history\n"
+        "   -f, --force          run every process even if it could be replayed\n"
+        "   -g, --gc             forget history that hasn't been used recently\n"
+        "       --gc-age=DAYS    with -g, forget history unused for DAYS days (default 30)\n"
+        "       --gc-budget=MB   with -g, also forget the oldest history until all\n"
+        "                        stored history fits in MB megabytes\n"
+        "   -p, --prime=DIR      hash every file under DIR into the stat cache\n"
+        "       --prime-threads=N\n"
+        "                        with -p, hash using N threads (default one per cpu)\n"
+        "   -w, --watch=DIR      watch DIR for changes so lookups can skip lstat\n"
+        "                        (runs until killed; Linux only)\n"
         "   -v, --verbose        be extremely verbose\n"
         "   -d, --dump           dump all subgraph information\n"
         "   -h, --help           print this help message\n");
@@ -42,6 +64,36 @@ static void usage()
 
 static int dump;
 
+/*
+ * gc and clean rewrite or remove the stores out from under anything else
+ * using them: processes of a running build would keep writing into unlinked
+ * maps and lose that history, and stored contents they just wrote could be
+ * swept.  So builds and priming hold WAITLESS_DIR/lock shared, and gc and
+ * clean take it exclusively, refusing to run rather than waiting for builds
+ * to finish.  The watcher doesn't take the lock, since it never exits.
+ */
+static int lock_fd = -1;
+
+static void lock_waitless_dir(int exclusive)
+{
+    const char *path = waitless_path("lock");
+    if (lock_fd < 0) {
+        lock_fd = real_open(path, O_CREAT | O_RDONLY, 0644);
+        if (lock_fd < 0)
+            die("can't open %s: %s", path, strerror(errno));
+        real_fcntl(lock_fd, F_SETFD, FD_CLOEXEC);
+    }
+    if (!exclusive) {
+        if (flock(lock_fd, LOCK_SH) < 0)
+            die("can't lock %s: %s", path, strerror(errno));
+    }
+    else if (flock(lock_fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK)
+            die("can't clean or gc while other waitless processes are using %s", waitless_env->dir);
+        die("can't lock %s: %s", path, strerror(errno));
+    }
+}
+
 static void cleanup(int signal)
 {
     // Kill and wait for all subprocesses
@@ -55,8 +107,8 @@ static void cleanup(int signal)
     snapshot_verify();
 
     // Remove the snapshot and process map
-    unlink(getenv(WAITLESS_SNAPSHOT));
-    unlink(getenv(WAITLESS_PROCESS));
+    unlink(waitless_env->snapshot);
+    unlink(waitless_env->process);
 
     if (signal)
         real__exit(1);
@@ -65,11 +117,25 @@ static void cleanup(int signal)
 int main(int argc, char **argv)
 {
     int clean = 0;
+    int force = 0;
+    int collect = 0;
+    int gc_age = 30;
+    uint64_t gc_budget = 0;
+    const char *prime_dir = 0;
+    int prime_threads = 0;
+    const char *watch_dir = 0;
     int verbose = 0;
 
-    const char *short_options = "+cvdh";
+    const char *short_options = "+cfgp:w:vdh";
     struct option long_options[] = {
         {"clean",   no_argument, 0, 'c'},
+        {"force",   no_argument, 0, 'f'},
+        {"gc",      no_argument, 0, 'g'},
+        {"gc-age",  required_argument, 0, 'A'},
+        {"gc-budget", required_argument, 0, 'B'},
+        {"prime",   required_argument, 0, 'p'},
+        {"prime-threads", required_argument, 0, 'T'},
+        {"watch",   required_argument, 0, 'w'},
         {"verbose", no_argument, 0, 'v'},
         {"dump",    no_argument, 0, 'd'},
         {"help",    no_argument, 0, 'h'},
@@ -86,6 +152,13 @@ int main(int argc, char **argv)
  
         switch (c) {
             case 'c': clean = 1; break;
+            case 'f': force = 1; break;
+            case 'g': collect = 1; break;
+            case 'A': gc_age = atoi(optarg); break;
+            case 'B': gc_budget = (uint64_t)atoi(optarg) << 20; break;
+            case 'p': prime_dir = optarg; break;
+            case 'T': prime_threads = atoi(optarg); break;
+            case 'w': watch_dir = optarg; break;
             case 'v': verbose = 1; break;
             case 'd': dump = 1; break;
             case 'h': usage();
@@ -93,19 +166,18 @@ int main(int argc, char **argv)
         }
     }
 
-    if (argc == optind && !clean && !dump)
+    if (argc == optind && !clean && !dump && !collect && !prime_dir && !watch_dir)
         usage();
     const char **cmd = argc == optind ? 0 : (const char**)(argv+optind);
 
     // Set WAITLESS_DIR to $HOME/.waitless by default
-    const char *waitless_dir = getenv(WAITLESS_DIR);
-    if (!waitless_dir) {
+    if (!waitless_env->dir) {
         const char *home = getenv("HOME");
         if (!home)
             die("either WAITLESS_DIR or HOME must be set");
-        setenv(WAITLESS_DIR, path_join(home, ".waitless"), 1);
-        waitless_dir = getenv(WAITLESS_DIR);
+        env_set(WAITLESS_DIR, path_join(home, ".waitless"));
     }
+    const char *waitless_dir = waitless_env->dir;
 
     // Make WAITLESS_DIR if it doesn't exist
     struct stat st;
@@ -116,18 +188,40 @@ int main(int argc, char **argv)
     else if (!(st.st_mode & S_IFDIR))
         die("WAITLESS_DIR '%s' is not a directory (mode 0%6o)", waitless_dir, st.st_mode);
 
-    // To clean, remove subgraph, stat_cache, and inverse.
+    if (clean || collect)
+        lock_waitless_dir(1);
+
+    // To clean, remove subgraph, stat_cache, inverse, and content.
     if (clean) {
         char clean[1024];
-        snprintf(clean, sizeof(clean), "cd %s && /bin/rm -rf subgraph stat_cache inverse spine.*", waitless_dir);
+        snprintf(clean, sizeof(clean), "cd %s && /bin/rm -rf subgraph* stat_cache* inverse* search_path* content gc.marks watch watch.cookies spine.*", waitless_dir);
         int r = system(clean);
         if (r)
             die("full clean (-C) failed, status %d", r);
     }
 
-    // Create and initialize the subgraph and stat cache if they don't exist
+    // Create and initialize the subgraph, stat cache, inverse map, and search
+    // memo if they don't exist
     subgraph_init();
     stat_cache_init();
+    inverse_map_init();
+    search_path_init();
+
+    if (collect)
+        gc(gc_age, gc_budget);
+
+    // Anything left to do only adds to the stores
+    if (prime_dir || cmd)
+        lock_waitless_dir(0);
+
+    if (prime_dir) {
+        if (prime_threads <= 0)
+            prime_threads = max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+        prime(prime_dir, prime_threads);
+    }
+
+    if (watch_dir)
+        watch(watch_dir);
 
     if (dump)
         subgraph_dump();
@@ -151,9 +245,11 @@ int main(int argc, char **argv)
     signal(SIGINT, cleanup);
     signal(SIGTERM, cleanup);
 
-    // Set verbose flag if desired
+    // Set verbose and force flags if desired
     if (verbose)
-        setenv(WAITLESS_VERBOSE, "1", 1);
+        env_set(WAITLESS_VERBOSE, "1");
+    if (force)
+        env_set(WAITLESS_FORCE, "1");
 
     // Add libwaitless.so to LD_PRELOAD (or the equivalent)
     if (getenv(PRELOAD_NAME))
@@ -174,27 +270,36 @@ int main(int argc, char **argv)
 
     // Find the correct absolute path to exec
     char buffer[PATH_MAX];
-    const char *path = search_path(buffer, cmd[0], 0);
+    const char *path = search_path(buffer, cmd[0], 0, 0, 0);
     if (!path)
         die("%s: command not found", cmd[0]);
 
+    // If the whole command tree would repeat a previous run exactly, replay
+    // its writes and exit status instead of running it.
+    extern const char **environ;
+    int status;
+    if (!force && replay_exec(path, cmd, environ, &status)) {
+        cleanup(0);
+        return status;
+    }
+
     // Invoke the command
     pid_t pid = real_fork();
     if (pid < 0)
         die("fork failed");
     else if (!pid) {
         // Create process info
+        inverse_map_forked();
         new_process_info(); 
         unlock_process();
 
         // Create the root exec node and then exec
-        extern const char **environ;
         action_execve(path, cmd, environ);
         die("failed to exec %s: ", cmd[0], strerror(errno));
     }
 
     // Wait for all children.
-    int status = waitall();
+    status = waitall();
 
     cleanup(0);
     return status;
@@ -0,0 +1,460 @@
+// Filesystem watcher for skipping lstat in the stat cache
+
+#include "watch.h"
+#include "stat_cache.h"
+#include "real_call.h"
+#include "env.h"
+#include "util.h"
+#include <errno.h>
+
+// State shared between the watcher and everyone else via WAITLESS_DIR/watch
+struct watch_state
+{
+    uint32_t pid;    // watcher process, or zero if none is running
+    uint32_t epoch;  // never zero
+    uint32_t seq;    // incremented before each batch of invalidations
+    uint32_t cookie; // last cookie handed out (see sync_watcher)
+    uint32_t synced; // newest cookie the watcher has seen
+    uint32_t padding;
+    char root[PATH_MAX]; // canonical absolute path of the watched tree
+};
+
+// Cookies are created in this directory under WAITLESS_DIR, which the watcher
+// watches along with the tree
+#define COOKIES "watch.cookies"
+
+// How long to wait for the watcher to see a cookie before giving up on it
+#define SYNC_TIMEOUT 2
+
+static volatile struct watch_state *state;
+static time_t synced_at; // when we last synced with the watcher, or zero
+static int unresponsive; // the watcher failed to sync, so stop asking
+
+static const char *watch_path()
+{
+    return waitless_path("watch");
+}
+
+static void map_state(int fd)
+{
+    state = mmap(0, sizeof(struct watch_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (state == MAP_FAILED)
+        die("watch: mmap failed: %s", strerror(errno));
+}
+
+// TODO: thread safety
+static void initialize()
+{
+    static int initialized = 0;
+    if (initialized)
+        return;
+    initialized = 1;
+
+    // No watch file means no watcher has ever run
+    int fd = real_open(watch_path(), O_RDWR, 0);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (real_fstat(fd, &st) < 0)
+        die("watch: fstat failed: %s", strerror(errno));
+    if (st.st_size >= sizeof(struct watch_state))
+        map_state(fd);
+    real_close(fd);
+}
+
+#ifdef __linux__
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+extern long syscall(long number, ...);
+
+// Sleep until *p may differ from value, or for at most ms milliseconds.  p is
+// in a shared mapping, so this has to be a shared futex.
+static void wait_changed(volatile uint32_t *p, uint32_t value, int ms)
+{
+    struct timespec timeout = { ms / 1000, ms % 1000 * 1000000 };
+    syscall(SYS_futex, p, FUTEX_WAIT, value, &timeout, 0, 0);
+}
+
+static void wake_all(volatile uint32_t *p)
+{
+    syscall(SYS_futex, p, FUTEX_WAKE, 1 << 30, 0, 0, 0);
+}
+
+#else
+
+// Only the Linux watcher exists, so nobody should ever get here
+static void wait_changed(volatile uint32_t *p, uint32_t value, int ms)
+{
+    struct timespec timeout = { 0, 1000000 };
+    nanosleep(&timeout, 0);
+}
+
+#endif
+
+static int watcher_alive()
+{
+    uint32_t pid = state->pid;
+    return pid && !(kill(pid, 0) < 0 && errno == ESRCH);
+}
+
+// Make sure the watcher has applied every change made before now.  inotify
+// delivers events in order, so we create a numbered cookie file where the
+// watcher is looking, and sleep until it reports a cookie at least that new.
+// Returns false if the watcher is dead or doesn't answer in time.
+static int sync_watcher()
+{
+    if (!watcher_alive())
+        return 0;
+    uint32_t n = __sync_add_and_fetch(&state->cookie, 1);
+    char name[32];
+    snprintf(name, sizeof(name), COOKIES "/%u", n);
+    const char *path = waitless_path(name);
+    int fd = real_open(path, O_CREAT | O_WRONLY, 0600);
+    if (fd < 0)
+        return 0;
+    real_close(fd);
+    unlink(path);
+
+    // The watcher wakes us whenever synced advances.  The timeout only
+    // matters if it dies, so that we notice.
+    time_t start = time(0);
+    for (;;) {
+        uint32_t synced = state->synced;
+        if ((int32_t)(synced - n) >= 0)
+            break;
+        if (!watcher_alive() || time(0) > start + SYNC_TIMEOUT)
+            return 0;
+        wait_changed(&state->synced, synced, 100);
+    }
+    __sync_synchronize();
+    return 1;
+}
+
+uint32_t watch_epoch()
+{
+    initialize();
+    if (!state || !state->pid || unresponsive)
+        return 0;
+
+    // Sync before trusting anything, and again once a second, which also
+    // notices a watcher that died without a chance to clean up
+    time_t now = time(0);
+    if (now != synced_at) {
+        if (!sync_watcher()) {
+            unresponsive = 1;
+            return 0;
+        }
+        synced_at = now;
+    }
+    uint32_t epoch = state->epoch;
+    __sync_synchronize();
+    return state->pid ? epoch : 0;
+}
+
+uint32_t watch_seq()
+{
+    initialize();
+    __sync_synchronize();
+    return state ? state->seq : 0;
+}
+
+int watch_covers(const char *path)
+{
+    initialize();
+    if (!state)
+        return 0;
+    const char *root = (const char*)state->root;
+    int n = strlen(root);
+    if (strncmp(path, root, n) || path[n] != '/')
+        return 0;
+
+    // Reject //, /./, and /../ components and trailing slashes
+    const char *p;
+    for (p = path + n; *p; p++)
+        if (p[0] == '/' && (!p[1] || p[1] == '/'
+            || (p[1] == '.' && (!p[2] || p[2] == '/'
+                || (p[2] == '.' && (!p[3] || p[3] == '/'))))))
+            return 0;
+    return 1;
+}
+
+#ifdef __linux__
+
+#include <sys/inotify.h>
+#include <dirent.h>
+
+// Use explicit forward declarations to avoid bringing in all of stdlib.h
+extern void *realloc(void *p, size_t n);
+extern void free(void *p);
+extern char *realpath(const char *path, char *resolved);
+extern int inotify_rm_watch(int fd, int wd);
+
+#define EVENTS (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+    | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_DONT_FOLLOW | IN_ONLYDIR)
+
+static int inotify_fd;
+static int root_wd, cookie_wd;
+static char waitless_dir[PATH_MAX];
+
+// Newest cookie seen in the current batch of events.  It is published only
+// once the batch's invalidations are applied.
+static uint32_t cookie_seen;
+
+// Map from watch descriptor to directory path
+static char **dirs;
+static int dir_count;
+
+static void new_epoch()
+{
+    // Zero means "no watcher", so skip it on wraparound
+    if (!__sync_add_and_fetch(&state->epoch, 1))
+        __sync_add_and_fetch(&state->epoch, 1);
+}
+
+// Called from die and on signals: make sure nobody trusts us anymore
+static void stop()
+{
+    state->pid = 0;
+    new_epoch();
+}
+
+static void stop_signal(int signal)
+{
+    stop();
+    real__exit(1);
+}
+
+// Paths changed in the current batch of events.  They're hashed together at
+// the end of the batch, since hash_memory_many is much faster than one
+// hash_string per event for short inputs like paths.
+#define PENDING_PATHS 1024
+static char pending_buffer[64*1024];
+static const void *pending[PENDING_PATHS];
+static size_t pending_length[PENDING_PATHS];
+static int pending_count, pending_used;
+
+static void flush_invalidations()
+{
+    struct hash hashes[PENDING_PATHS];
+    hash_memory_many(pending_count, hashes, pending, pending_length);
+    int i;
+    for (i = 0; i < pending_count; i++)
+        stat_cache_invalidate(hashes + i);
+    pending_count = pending_used = 0;
+}
+
+static void invalidate(const char *path)
+{
+    size_t n = strlen(path);
+    if (pending_count == PENDING_PATHS || pending_used + n > sizeof(pending_buffer))
+        flush_invalidations();
+    memcpy(pending_buffer + pending_used, path, n);
+    pending[pending_count] = pending_buffer + pending_used;
+    pending_length[pending_count++] = n;
+    pending_used += n;
+}
+
+static int is_dir_symlink(const char *path, const struct stat *lst)
+{
+    struct stat st;
+    return S_ISLNK(lst->st_mode) && real_stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void add_watch(const char *path)
+{
+    int wd = inotify_add_watch(inotify_fd, path, EVENTS);
+    if (wd < 0) {
+        // The directory may already be gone
+        if (errno == ENOENT || errno == ENOTDIR)
+            return;
+        if (errno == ENOSPC)
+            die("watch: out of inotify watches; raise fs.inotify.max_user_watches");
+        die("watch: inotify_add_watch(\"%s\") failed: %s", path, strerror(errno));
+    }
+    if (wd >= dir_count) {
+        int count = max(2*dir_count, wd + 1024);
+        dirs = realloc(dirs, count * sizeof(char*));
+        if (!dirs)
+            die("watch: out of memory");
+        memset(dirs + dir_count, 0, (count - dir_count) * sizeof(char*));
+        dir_count = count;
+    }
+    free(dirs[wd]);
+    dirs[wd] = strdup(path);
+}
+
+static void add_tree(char path[PATH_MAX], int n)
+{
+    if (!strcmp(path, waitless_dir))
+        return;
+    add_watch(path);
+
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        int m = n + 1 + strlen(e->d_name);
+        if (m >= PATH_MAX)
+            continue;
+        path[n] = '/';
+        strcpy(path + n + 1, e->d_name);
+
+        struct stat st;
+        if (real_lstat(path, &st) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            add_tree(path, m);
+        else if (is_dir_symlink(path, &st))
+            die("watch: %s is a symlink to a directory, which the watcher can't follow", path);
+    }
+    path[n] = 0;
+    closedir(dir);
+}
+
+// Stop watching a directory and everything under it
+static void forget_tree(const char *path)
+{
+    int n = strlen(path), wd;
+    for (wd = 0; wd < dir_count; wd++)
+        if (dirs[wd] && !strncmp(dirs[wd], path, n) && (!dirs[wd][n] || dirs[wd][n] == '/')) {
+            inotify_rm_watch(inotify_fd, wd);
+            free(dirs[wd]);
+            dirs[wd] = 0;
+        }
+}
+
+static void handle(const struct inotify_event *e)
+{
+    if (e->mask & IN_Q_OVERFLOW) {
+        // We've lost track of what changed
+        new_epoch();
+        return;
+    }
+    if (e->wd == cookie_wd) {
+        uint32_t n = 0;
+        const char *p;
+        for (p = e->name; e->len && '0' <= *p && *p <= '9'; p++)
+            n = 10 * n + *p - '0';
+        if ((int32_t)(n - cookie_seen) > 0)
+            cookie_seen = n;
+        return;
+    }
+    const char *dir = e->wd >= 0 && e->wd < dir_count ? dirs[e->wd] : 0;
+    if (!dir)
+        return;
+    if (e->mask & IN_IGNORED) {
+        free(dirs[e->wd]);
+        dirs[e->wd] = 0;
+        return;
+    }
+    if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // Other directories are handled via events on their parents
+        if (e->wd == root_wd)
+            die("watch: %s was moved or removed", dir);
+        return;
+    }
+
+    char path[PATH_MAX];
+    strlcpy(path, e->len ? path_join(dir, e->name) : dir, sizeof(path));
+    invalidate(path);
+
+    if (e->mask & IN_ISDIR) {
+        // Everything under a removed or renamed directory changes at once
+        if (e->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+            new_epoch();
+        if (e->mask & IN_MOVED_FROM)
+            forget_tree(path);
+        if (e->mask & (IN_CREATE | IN_MOVED_TO))
+            add_tree(path, strlen(path));
+    }
+    else if (e->mask & (IN_CREATE | IN_MOVED_TO)) {
+        struct stat st;
+        if (real_lstat(path, &st) == 0 && is_dir_symlink(path, &st))
+            die("watch: %s is a symlink to a directory, which the watcher can't follow", path);
+    }
+}
+
+void watch(const char *dir)
+{
+    char root[PATH_MAX];
+    if (!realpath(dir, root))
+        die("watch: can't resolve %s: %s", dir, strerror(errno));
+    if (!realpath(waitless_env->dir, waitless_dir))
+        die("watch: can't resolve WAITLESS_DIR: %s", strerror(errno));
+
+    int fd = real_open(watch_path(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(struct watch_state)) < 0)
+        die("watch: can't create %s: %s", watch_path(), strerror(errno));
+    map_state(fd);
+    real_close(fd);
+    if (state->pid && !(kill(state->pid, 0) < 0 && errno == ESRCH))
+        die("watch: already running as process %d", state->pid);
+
+    // From here on, make sure nobody trusts entries if we exit
+    at_die = stop;
+    signal(SIGINT, stop_signal);
+    signal(SIGTERM, stop_signal);
+    signal(SIGHUP, stop_signal);
+
+    inotify_fd = inotify_init();
+    if (inotify_fd < 0)
+        die("watch: inotify_init failed: %s", strerror(errno));
+    char path[PATH_MAX];
+    strlcpy(path, root, sizeof(path));
+    add_tree(path, strlen(path));
+    root_wd = inotify_add_watch(inotify_fd, root, EVENTS);
+
+    // Watch for cookies from processes syncing with us
+    const char *cookies = waitless_path(COOKIES);
+    if (mkdir(cookies, 0755) < 0 && errno != EEXIST)
+        die("watch: can't create %s: %s", cookies, strerror(errno));
+    cookie_wd = inotify_add_watch(inotify_fd, cookies, IN_CREATE | IN_CLOSE_WRITE);
+    if (cookie_wd < 0)
+        die("watch: inotify_add_watch(\"%s\") failed: %s", cookies, strerror(errno));
+
+    // Start a fresh epoch so that nothing from a previous watcher is trusted,
+    // then announce ourselves
+    strlcpy((char*)state->root, root, sizeof(state->root));
+    cookie_seen = state->synced = state->cookie;
+    new_epoch();
+    __sync_synchronize();
+    state->pid = getpid();
+    fdprintf(STDOUT_FILENO, "watch: watching %s\n", root);
+
+    char buffer[64*1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            die("watch: read failed: %s", strerror(errno));
+        }
+        __sync_add_and_fetch(&state->seq, 1);
+        const char *p;
+        for (p = buffer; p < buffer + n; ) {
+            const struct inotify_event *e = (const struct inotify_event*)p;
+            handle(e);
+            p += sizeof(struct inotify_event) + e->len;
+        }
+        flush_invalidations();
+        __sync_synchronize();
+        if (state->synced != cookie_seen) {
+            state->synced = cookie_seen;
+            wake_all(&state->synced);
+        }
+    }
+}
+
+#else
+
+void watch(const char *dir)
+{
+    die("watch: only supported on Linux (inotify)");
+}
+
+#endif
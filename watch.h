@@ -0,0 +1,49 @@
+// Filesystem watcher for skipping lstat in the stat cache
+
+#ifndef __watch_h__
+#define __watch_h__
+
+#include "hash.h"
+
+/*
+ * Without help, every stat cache lookup must lstat the file to see whether
+ * it changed, so a no-op build over a large tree is dominated by metadata
+ * system calls.  waitless --watch runs a resident watcher which subscribes to
+ * a directory tree (currently via inotify, so Linux only) and invalidates stat
+ * cache entries as soon as it hears about changes to the corresponding paths.
+ *
+ * The watcher publishes an epoch in WAITLESS_DIR/watch.  A stat cache entry
+ * that was lstat'ed during the current epoch and hasn't been invalidated
+ * since can be trusted without calling lstat.  Anything the watcher can't
+ * track precisely (queue overflow, directory renames or removals) simply
+ * starts a new epoch, which invalidates everything at once.
+ *
+ * Changes become visible only once the watcher has processed them, so before
+ * trusting anything, each process syncs with the watcher: it creates a cookie
+ * file in WAITLESS_DIR/watch.cookies and waits until the watcher reports
+ * having seen it, by which point every earlier change has been applied.  A
+ * process syncs again once a second, which also bounds how long it keeps
+ * trusting a watcher that was killed without a chance to clean up.  If the
+ * watcher doesn't answer, the process stops trusting it.
+ *
+ * Directory symlinks inside the tree would create paths the watcher never
+ * hears about, so the watcher refuses to run if it finds one.
+ */
+
+// Watch the tree under dir until killed.
+extern void watch(const char *dir);
+
+// Return the current epoch if a watcher is running and we are in sync with it
+// (see above), otherwise zero.
+extern uint32_t watch_epoch();
+
+// A counter which the watcher increments before applying each batch of
+// invalidations.  An entry may be marked clean only if the counter is
+// unchanged between its lstat and the marking.
+extern uint32_t watch_seq();
+
+// Is path (absolute) covered by the watcher?  Only canonical paths under the
+// watched root are, since the watcher reports changes by canonical path.
+extern int watch_covers(const char *path);
+
+#endif